@@ -69,6 +69,22 @@ static void SipHash_32b(benchmark::State& state)
     }
 }
 
+static void SipHash_32b_Lanes(benchmark::State& state)
+{
+    uint256 x[SIPHASH_LANES];
+    const uint256* px[SIPHASH_LANES];
+    uint64_t out[SIPHASH_LANES];
+    for (size_t l = 0; l < SIPHASH_LANES; l++)
+        px[l] = &x[l];
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000000; i += SIPHASH_LANES) {
+            SipHashUint256Lanes(0, i, px, out);
+            for (size_t l = 0; l < SIPHASH_LANES; l++)
+                *((uint64_t*)x[l].begin()) = out[l];
+        }
+    }
+}
+
 BENCHMARK(RIPEMD160);
 BENCHMARK(SHA1);
 BENCHMARK(SHA256);
@@ -76,3 +92,4 @@ BENCHMARK(SHA512);
 
 BENCHMARK(SHA256_32b);
 BENCHMARK(SipHash_32b);
+BENCHMARK(SipHash_32b_Lanes);
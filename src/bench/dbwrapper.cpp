@@ -0,0 +1,159 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "coins.h"
+#include "dbwrapper.h"
+#include "random.h"
+#include "script/script.h"
+
+#include <boost/filesystem.hpp>
+
+// Replays a chainstate access trace against LevelDB with different tuning
+// parameters. The trace mimics what block connection does to the coin
+// database: look up the spent outputs and the new ones (which mostly miss),
+// then commit one batch that erases the former and writes the latter.
+
+static const size_t TRACE_BASE_COINS = 20000;
+static const size_t TRACE_BLOCKS = 256;
+static const size_t TRACE_SPENDS_PER_BLOCK = 500;
+static const size_t TRACE_CREATES_PER_BLOCK = 600;
+static const size_t TRACE_DB_CACHE = 8 << 20;
+
+struct TraceBlock
+{
+    std::vector<COutPoint> vSpent;
+    std::vector<std::pair<COutPoint, Coin> > vCreated;
+};
+
+struct ChainstateTrace
+{
+    std::vector<std::pair<COutPoint, Coin> > vBase;
+    std::vector<TraceBlock> vBlocks;
+};
+
+static uint256 TraceHash(FastRandomContext& rand)
+{
+    uint256 hash;
+    for (unsigned char* p = hash.begin(); p != hash.end(); p += 4) {
+        uint32_t n = rand.rand32();
+        memcpy(p, &n, 4);
+    }
+    return hash;
+}
+
+static std::pair<COutPoint, Coin> TraceCoin(FastRandomContext& rand, int nHeight)
+{
+    CScript script;
+    script << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, rand.rand32() & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG;
+    return std::make_pair(COutPoint(TraceHash(rand), rand.rand32() % 3), Coin(CTxOut(rand.rand32() % 100000000, script), nHeight, false));
+}
+
+static const ChainstateTrace& GetTrace()
+{
+    static ChainstateTrace trace;
+    if (!trace.vBase.empty())
+        return trace;
+
+    FastRandomContext rand(true);
+    std::vector<COutPoint> vUnspent;
+    for (size_t i = 0; i < TRACE_BASE_COINS; i++) {
+        trace.vBase.push_back(TraceCoin(rand, 0));
+        vUnspent.push_back(trace.vBase.back().first);
+    }
+    for (size_t nBlock = 0; nBlock < TRACE_BLOCKS; nBlock++) {
+        TraceBlock block;
+        for (size_t i = 0; i < TRACE_SPENDS_PER_BLOCK && !vUnspent.empty(); i++) {
+            // Recently created outputs are spent more often than old ones.
+            size_t nPos = rand.rand32() % 2 ? vUnspent.size() - 1 - rand.rand32() % std::min(vUnspent.size(), (size_t)5000) : rand.rand32() % vUnspent.size();
+            block.vSpent.push_back(vUnspent[nPos]);
+            vUnspent[nPos] = vUnspent.back();
+            vUnspent.pop_back();
+        }
+        for (size_t i = 0; i < TRACE_CREATES_PER_BLOCK; i++) {
+            block.vCreated.push_back(TraceCoin(rand, nBlock + 1));
+            vUnspent.push_back(block.vCreated.back().first);
+        }
+        trace.vBlocks.push_back(block);
+    }
+    return trace;
+}
+
+static void ReplayChainstateTrace(benchmark::State& state, const CDBOptions& dbOptions)
+{
+    const ChainstateTrace& trace = GetTrace();
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    {
+        CDBWrapper db(ph, TRACE_DB_CACHE, false, true, true, dbOptions);
+        CDBBatch batch(db);
+        for (const auto& entry : trace.vBase)
+            batch.Write(std::make_pair('C', entry.first), entry.second);
+        db.WriteBatch(batch);
+
+        size_t nBlock = 0;
+        while (state.KeepRunning()) {
+            const TraceBlock& block = trace.vBlocks[nBlock++ % trace.vBlocks.size()];
+            Coin coin;
+            for (const auto& out : block.vSpent)
+                db.Read(std::make_pair('C', out), coin);
+            for (const auto& entry : block.vCreated)
+                db.Exists(std::make_pair('C', entry.first));
+
+            batch.Clear();
+            for (const auto& out : block.vSpent)
+                batch.Erase(std::make_pair('C', out));
+            for (const auto& entry : block.vCreated)
+                batch.Write(std::make_pair('C', entry.first), entry.second);
+            db.WriteBatch(batch);
+        }
+    }
+    boost::filesystem::remove_all(ph);
+}
+
+static void DBWrapperDefault(benchmark::State& state)
+{
+    ReplayChainstateTrace(state, CDBOptions());
+}
+
+static void DBWrapperNoBloomFilter(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nBloomBits = 0;
+    ReplayChainstateTrace(state, dbOptions);
+}
+
+static void DBWrapperLargeBlocks(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nBlockSize = 64 << 10;
+    ReplayChainstateTrace(state, dbOptions);
+}
+
+static void DBWrapperSmallWriteBuffer(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.nWriteBufferSize = 256 << 10;
+    ReplayChainstateTrace(state, dbOptions);
+}
+
+static void DBWrapperCompression(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.fCompression = true;
+    ReplayChainstateTrace(state, dbOptions);
+}
+
+static void DBWrapperSharedCache(benchmark::State& state)
+{
+    CDBOptions dbOptions;
+    dbOptions.blockCache = NewDBBlockCache(TRACE_DB_CACHE);
+    ReplayChainstateTrace(state, dbOptions);
+}
+
+BENCHMARK(DBWrapperDefault);
+BENCHMARK(DBWrapperNoBloomFilter);
+BENCHMARK(DBWrapperLargeBlocks);
+BENCHMARK(DBWrapperSmallWriteBuffer);
+BENCHMARK(DBWrapperCompression);
+BENCHMARK(DBWrapperSharedCache);
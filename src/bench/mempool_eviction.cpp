@@ -4,6 +4,7 @@
 
 #include "bench.h"
 #include "policy/policy.h"
+#include "random.h"
 #include "txmempool.h"
 
 #include <list>
@@ -22,9 +23,8 @@ static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
                                         tx.GetValueOut(), spendsCoinbase, sigOpCost, lp));
 }
 
-// Right now this is only testing eviction performance in an extremely small
-// mempool. Code needs to be written to generate a much wider variety of
-// unique transactions for a more meaningful performance measurement.
+// Eviction performance in an extremely small mempool; see
+// MempoolEvictionLarge below for a full one.
 static void MempoolEviction(benchmark::State& state)
 {
     CMutableTransaction tx1 = CMutableTransaction();
@@ -113,3 +113,42 @@ static void MempoolEviction(benchmark::State& state)
 }
 
 BENCHMARK(MempoolEviction);
+
+static const unsigned int LARGE_POOL_TXS = 100000;
+static const unsigned int LARGE_POOL_FLOOD = 1000;
+
+// Adds nCount unique transactions with random fees, in chains of up to four
+static void AddChainedTxs(CTxMemPool& pool, FastRandomContext& rand, uint32_t& nTx, unsigned int nCount)
+{
+    CTransactionRef parent;
+    for (unsigned int i = 0; i < nCount; i++, nTx++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = nTx % 4 ? COutPoint(parent->GetHash(), 0) : COutPoint(uint256(), nTx);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        parent = MakeTransactionRef(tx);
+        AddTx(*parent, 1000 + rand.rand32() % 100000, pool);
+    }
+}
+
+// A flood of new transactions against a full mempool of 100k entries, each
+// round evicting about as much as it added.
+static void MempoolEvictionLarge(benchmark::State& state)
+{
+    FastRandomContext rand(true);
+    CTxMemPool pool(CFeeRate(1000));
+    uint32_t nTx = 0;
+    AddChainedTxs(pool, rand, nTx, LARGE_POOL_TXS);
+    const size_t nLimit = pool.DynamicMemoryUsage();
+
+    while (state.KeepRunning()) {
+        AddChainedTxs(pool, rand, nTx, LARGE_POOL_FLOOD);
+        std::vector<COutPoint> vNoSpendsRemaining;
+        pool.TrimToSize(nLimit, &vNoSpendsRemaining);
+    }
+}
+
+BENCHMARK(MempoolEvictionLarge);
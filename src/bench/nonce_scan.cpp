@@ -0,0 +1,48 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "miner.h"
+#include "primitives/block.h"
+#include "random.h"
+
+static CBlockHeader ScanHeader()
+{
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1480000000;
+    header.nBits = 0x1d00ffff;
+    header.nNonce = 0;
+    return header;
+}
+
+// Hash the full serialized header for every nonce
+static void NonceScan_GetHash(benchmark::State& state)
+{
+    CBlockHeader header = ScanHeader();
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            header.nNonce++;
+            header.GetHash();
+        }
+    }
+}
+
+// Hash from the midstate of the first 64 header bytes
+static void NonceScan_Midstate(benchmark::State& state)
+{
+    CBlockHeader header = ScanHeader();
+    const CHeaderHasher hasher(header);
+    uint32_t nNonce = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1000; i++) {
+            hasher.GetHash(++nNonce);
+        }
+    }
+}
+
+BENCHMARK(NonceScan_GetHash);
+BENCHMARK(NonceScan_Midstate);
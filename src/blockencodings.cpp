@@ -15,6 +15,9 @@
 
 #include <unordered_map>
 
+//! Size in bits of the short ID prefilter used by InitData (a power of two)
+static const uint64_t SHORTID_FILTER_BITS = 1 << 16;
+
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
@@ -45,6 +48,12 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const {
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+void CBlockHeaderAndShortTxIDs::GetShortIDs(const uint256* const* txhashes, uint64_t* shortids) const {
+    SipHashUint256Lanes(shorttxidk0, shorttxidk1, txhashes, shortids);
+    for (size_t l = 0; l < SIPHASH_LANES; l++)
+        shortids[l] &= 0xffffffffffffL;
+}
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock) {
@@ -103,32 +112,51 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     if (shorttxids.size() != cmpctblock.shorttxids.size())
         return READ_STATUS_FAILED; // Short ID collision
 
+    // Bitmap over the low bits of the block's short IDs. Most mempool
+    // transactions are not in the block, and this rules them out without a
+    // map lookup.
+    std::vector<uint64_t> shortidfilter(SHORTID_FILTER_BITS / 64);
+    for (uint64_t shortid : cmpctblock.shorttxids)
+        shortidfilter[(shortid % SHORTID_FILTER_BITS) / 64] |= (uint64_t)1 << (shortid % 64);
+
     std::vector<bool> have_txn(txn_available.size());
     LOCK(pool->cs);
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
-                mempool_count++;
-            } else {
-                // If we find two mempool txn that match the short id, just request it.
-                // This should be rare enough that the extra bandwidth doesn't matter,
-                // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
-                    mempool_count--;
+    const uint256* txhashes[SIPHASH_LANES];
+    uint64_t txshortids[SIPHASH_LANES];
+    for (size_t i = 0; i < vTxHashes.size() && mempool_count != shorttxids.size(); i += SIPHASH_LANES) {
+        // Short IDs are computed a few at a time; a short last group repeats its final hash.
+        size_t lanes = std::min(SIPHASH_LANES, vTxHashes.size() - i);
+        for (size_t l = 0; l < SIPHASH_LANES; l++)
+            txhashes[l] = &vTxHashes[i + std::min(l, lanes - 1)].first;
+        cmpctblock.GetShortIDs(txhashes, txshortids);
+
+        for (size_t l = 0; l < lanes; l++) {
+            uint64_t shortid = txshortids[l];
+            if (!(shortidfilter[(shortid % SHORTID_FILTER_BITS) / 64] & ((uint64_t)1 << (shortid % 64))))
+                continue;
+            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
+            if (idit != shorttxids.end()) {
+                if (!have_txn[idit->second]) {
+                    txn_available[idit->second] = vTxHashes[i + l].second->GetSharedTx();
+                    have_txn[idit->second]  = true;
+                    mempool_count++;
+                } else {
+                    // If we find two mempool txn that match the short id, just request it.
+                    // This should be rare enough that the extra bandwidth doesn't matter,
+                    // but eating a round-trip due to FillBlock failure would be annoying
+                    if (txn_available[idit->second]) {
+                        txn_available[idit->second].reset();
+                        mempool_count--;
+                    }
                 }
             }
+            // Though ideally we'd continue scanning for the two-txn-match-shortid case,
+            // the performance win of an early exit here is too good to pass up and worth
+            // the extra risk.
+            if (mempool_count == shorttxids.size())
+                break;
         }
-        // Though ideally we'd continue scanning for the two-txn-match-shortid case,
-        // the performance win of an early exit here is too good to pass up and worth
-        // the extra risk.
-        if (mempool_count == shorttxids.size())
-            break;
     }
 
     LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -150,3 +150,109 @@ int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& fr
     }
     return sign * r.GetLow64();
 }
+
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
+{
+    if (pa->nHeight > pb->nHeight) {
+        pa = pa->GetAncestor(pb->nHeight);
+    } else if (pb->nHeight > pa->nHeight) {
+        pb = pb->GetAncestor(pa->nHeight);
+    }
+
+    while (pa != pb && pa && pb) {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+
+    // Eventually all chain branches meet at the genesis block.
+    assert(pa == pb);
+    return pa;
+}
+
+/**
+ * CBlockIndexMap implementation
+ */
+static inline uint32_t BlockIndexMapTag(const uint256& hash)
+{
+    // The low 64 bits select the bucket; use other bits to tell entries apart.
+    return ReadLE32(hash.begin() + 8);
+}
+
+CBlockIndexMap::iterator CBlockIndexMap::find(const uint256& hash) const
+{
+    if (vSlots.empty())
+        return end();
+    const size_t nMask = vSlots.size() - 1;
+    const uint32_t nTag = BlockIndexMapTag(hash);
+    for (size_t i = hash.GetCheapHash() & nMask; vSlots[i].nPos != 0; i = (i + 1) & nMask) {
+        if (vSlots[i].nTag == nTag && GetEntry(vSlots[i].nPos - 1).value.first == hash)
+            return iterator(this, vSlots[i].nPos - 1);
+    }
+    return end();
+}
+
+CBlockIndex* CBlockIndexMap::operator[](const uint256& hash) const
+{
+    iterator it = find(hash);
+    return it == end() ? NULL : it->second;
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const uint256& hash)
+{
+    iterator it = find(hash);
+    if (it != end())
+        return std::make_pair(it, false);
+
+    reserve(nSize + 1);
+    if (nSize % CHUNK_SIZE == 0) {
+        vChunks.reserve(vChunks.size() + 1);
+        vChunks.push_back(static_cast<Entry*>(::operator new(sizeof(Entry) * CHUNK_SIZE)));
+    }
+    new (&vChunks.back()[nSize % CHUNK_SIZE]) Entry(hash);
+
+    const size_t nMask = vSlots.size() - 1;
+    size_t i = hash.GetCheapHash() & nMask;
+    while (vSlots[i].nPos != 0)
+        i = (i + 1) & nMask;
+    vSlots[i].nTag = BlockIndexMapTag(hash);
+    vSlots[i].nPos = ++nSize;
+    return std::make_pair(iterator(this, nSize - 1), true);
+}
+
+void CBlockIndexMap::reserve(size_t nCount)
+{
+    // Keep the load factor below 3/4 so probe sequences stay short.
+    size_t nSlots = std::max(vSlots.size(), (size_t)64);
+    while (nCount * 4 > nSlots * 3)
+        nSlots *= 2;
+    if (nSlots != vSlots.size())
+        Rehash(nSlots);
+}
+
+void CBlockIndexMap::Rehash(size_t nSlots)
+{
+    std::vector<Slot> vOld;
+    vOld.swap(vSlots);
+    Slot empty = {0, 0};
+    vSlots.assign(nSlots, empty);
+    const size_t nMask = nSlots - 1;
+    for (const Slot& slot : vOld) {
+        if (slot.nPos == 0)
+            continue;
+        size_t i = GetEntry(slot.nPos - 1).value.first.GetCheapHash() & nMask;
+        while (vSlots[i].nPos != 0)
+            i = (i + 1) & nMask;
+        vSlots[i] = slot;
+    }
+}
+
+void CBlockIndexMap::clear()
+{
+    for (size_t nPos = 0; nPos < nSize; nPos++)
+        GetEntry(nPos).~Entry();
+    for (Entry* chunk : vChunks)
+        ::operator delete(chunk);
+    vChunks.clear();
+    std::vector<Slot>().swap(vSlots);
+    nSize = 0;
+}
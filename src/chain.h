@@ -12,6 +12,8 @@
 #include "tinyformat.h"
 #include "uint256.h"
 
+#include <iterator>
+#include <utility>
 #include <vector>
 
 class CBlockFileInfo
@@ -340,6 +342,10 @@ arith_uint256 GetBlockProof(const CBlockIndex& block);
 /** Return the time it would take to redo the work difference between from and to, assuming the current hashrate corresponds to the difficulty at tip, in seconds. */
 int64_t GetBlockProofEquivalentTime(const CBlockIndex& to, const CBlockIndex& from, const CBlockIndex& tip, const Consensus::Params&);
 
+/** Find the last common ancestor two blocks have.
+ *  Both pa and pb must be non-NULL. */
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb);
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -405,6 +411,101 @@ public:
     }
 };
 
+/**
+ * Map from block hash to CBlockIndex that owns its entries.
+ *
+ * Entries are placement-constructed in large chunks, in insertion order (which
+ * is height order when loading), so that walking pprev/pskip touches nearby
+ * memory and no per-entry heap allocation is needed. Lookups go through an
+ * open-addressing table of (tag, position) slots with linear probing; the
+ * position of an entry, and thus its address, never changes. Entries cannot
+ * be erased individually.
+ *
+ * The interface follows the subset of std::unordered_map that callers use;
+ * iteration is in insertion order.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef std::pair<const uint256, CBlockIndex*> value_type;
+
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CBlockIndexMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type* pointer;
+        typedef value_type& reference;
+
+        iterator() : pmap(NULL), nPos(0) {}
+        reference operator*() const { return pmap->GetEntry(nPos).value; }
+        pointer operator->() const { return &pmap->GetEntry(nPos).value; }
+        iterator& operator++() { nPos++; return *this; }
+        iterator operator++(int) { iterator ret = *this; nPos++; return ret; }
+        bool operator==(const iterator& other) const { return nPos == other.nPos; }
+        bool operator!=(const iterator& other) const { return nPos != other.nPos; }
+
+    private:
+        const CBlockIndexMap* pmap;
+        size_t nPos;
+
+        iterator(const CBlockIndexMap* pmapIn, size_t nPosIn) : pmap(pmapIn), nPos(nPosIn) {}
+        friend class CBlockIndexMap;
+    };
+    typedef iterator const_iterator;
+
+    CBlockIndexMap() : nSize(0) {}
+    ~CBlockIndexMap() { clear(); }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, nSize); }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) const;
+    size_t count(const uint256& hash) const { return find(hash) != end(); }
+    //! Return the entry for hash, or NULL if there is none (unlike std::map, never inserts)
+    CBlockIndex* operator[](const uint256& hash) const;
+
+    /**
+     * Add a default-constructed entry for hash, with phashBlock pointing to
+     * its key, unless there already is one. Returns the entry and whether it
+     * is new.
+     */
+    std::pair<iterator, bool> insert(const uint256& hash);
+    void reserve(size_t nCount);
+    void clear();
+
+private:
+    struct Entry
+    {
+        value_type value;
+        CBlockIndex index;
+
+        Entry(const uint256& hash) : value(hash, &index) { index.phashBlock = &value.first; }
+    };
+
+    struct Slot
+    {
+        uint32_t nTag;
+        //! One more than the position of the entry, or 0 for an empty slot
+        uint32_t nPos;
+    };
+
+    static const size_t CHUNK_SIZE = 1024;
+
+    std::vector<Entry*> vChunks;
+    std::vector<Slot> vSlots;
+    size_t nSize;
+
+    Entry& GetEntry(size_t nPos) const { return vChunks[nPos / CHUNK_SIZE][nPos % CHUNK_SIZE]; }
+    void Rehash(size_t nSlots);
+
+    CBlockIndexMap(const CBlockIndexMap&);
+    void operator=(const CBlockIndexMap&);
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -15,14 +15,49 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CDBOptions::CDBOptions() :
+    nBlockSize(DEFAULT_DB_BLOCK_SIZE),
+    nWriteBufferSize(0),
+    nMaxOpenFiles(DEFAULT_DB_MAX_OPEN_FILES),
+    nBloomBits(DEFAULT_DB_BLOOM_BITS),
+    fCompression(DEFAULT_DB_COMPRESSION)
+{
+}
+
+CDBOptions CDBOptions::FromArgs(const std::string& strName)
+{
+    CDBOptions dbOptions;
+    std::string strPrefix = "-" + strName + "-db";
+    dbOptions.nBlockSize = std::max((int64_t)1024, GetArg(strPrefix + "blocksize", GetArg("-dbblocksize", dbOptions.nBlockSize)));
+    dbOptions.nWriteBufferSize = std::max((int64_t)0, GetArg(strPrefix + "writebuffer", GetArg("-dbwritebuffer", 0)) << 20);
+    dbOptions.nMaxOpenFiles = std::max((int64_t)16, GetArg(strPrefix + "maxopenfiles", GetArg("-dbmaxopenfiles", dbOptions.nMaxOpenFiles)));
+    dbOptions.nBloomBits = std::max((int64_t)0, GetArg(strPrefix + "bloombits", GetArg("-dbbloombits", dbOptions.nBloomBits)));
+    dbOptions.fCompression = GetBoolArg(strPrefix + "compression", GetBoolArg("-dbcompression", dbOptions.fCompression));
+    return dbOptions;
+}
+
+std::shared_ptr<leveldb::Cache> NewDBBlockCache(size_t nCacheSize)
+{
+    return std::shared_ptr<leveldb::Cache>(leveldb::NewLRUCache(nCacheSize));
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    if (dbOptions.blockCache) {
+        options.block_cache = dbOptions.blockCache.get();
+    } else {
+        options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
+    }
+    if (dbOptions.nWriteBufferSize) {
+        options.write_buffer_size = dbOptions.nWriteBufferSize;
+    } else {
+        options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    }
+    options.block_size = dbOptions.nBlockSize;
+    options.filter_policy = dbOptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits) : NULL;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,15 +66,16 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBOptions& dbOptions)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, dbOptions);
     options.create_if_missing = true;
+    blockCache = dbOptions.blockCache;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
         options.env = penv;
@@ -55,6 +91,8 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+    LogPrint("leveldb", "LevelDB options for %s: block_size=%u write_buffer_size=%u max_open_files=%d bloom_bits=%d compression=%d shared_cache=%d\n",
+        path.string(), options.block_size, options.write_buffer_size, options.max_open_files, dbOptions.nBloomBits, dbOptions.fCompression, (bool)blockCache);
 
     // The base-case obfuscation key, which is a noop.
     obfuscate_key = std::vector<unsigned char>(OBFUSCATE_KEY_NUM_BYTES, '\000');
@@ -82,8 +120,10 @@ CDBWrapper::~CDBWrapper()
     pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
-    delete options.block_cache;
+    if (!blockCache)
+        delete options.block_cache;
     options.block_cache = NULL;
+    blockCache.reset();
     delete penv;
     options.env = NULL;
 }
@@ -14,12 +14,25 @@
 
 #include <boost/filesystem/path.hpp>
 
+#include <memory>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
 
+//! -dbblocksize default (bytes)
+static const size_t DEFAULT_DB_BLOCK_SIZE = 4096;
+//! -dbmaxopenfiles default
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+//! -dbbloombits default
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! -dbcompression default
+static const bool DEFAULT_DB_COMPRESSION = false;
+//! -dbsharedcache default
+static const bool DEFAULT_DB_SHARED_CACHE = false;
+
 class dbwrapper_error : public std::runtime_error
 {
 public:
@@ -28,6 +41,34 @@ public:
 
 class CDBWrapper;
 
+/** LevelDB tuning parameters of a CDBWrapper */
+struct CDBOptions
+{
+    //! Approximate amount of user data packed per block (bytes)
+    size_t nBlockSize;
+    //! Size of the in-memory write buffer; 0 = a quarter of the cache size (bytes)
+    size_t nWriteBufferSize;
+    //! Number of table files LevelDB may keep open
+    int nMaxOpenFiles;
+    //! Bloom filter bits per key; 0 = no filter
+    int nBloomBits;
+    //! Compress blocks (only effective if LevelDB was built with Snappy)
+    bool fCompression;
+    //! Block cache to use instead of a private one of half the cache size
+    std::shared_ptr<leveldb::Cache> blockCache;
+
+    CDBOptions();
+
+    /**
+     * Read the -db* options. Each can be overridden for a single database
+     * with -<strName>-db*, e.g. -chainstate-dbbloombits.
+     */
+    static CDBOptions FromArgs(const std::string& strName);
+};
+
+/** Create a LevelDB block cache that can be shared between several databases */
+std::shared_ptr<leveldb::Cache> NewDBBlockCache(size_t nCacheSize);
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -56,11 +97,19 @@ private:
     CDataStream ssKey;
     CDataStream ssValue;
 
+    size_t size_estimate;
+
 public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) { };
+    CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
 
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -75,6 +124,14 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        // LevelDB serializes writes as:
+        // - byte: header
+        // - varint: key length (1 byte up to 127B, 2 bytes up to 16383B, ...)
+        // - byte[]: key
+        // - varint: value length
+        // - byte[]: value
+        // The formula below assumes the key and value are both less than 16k.
+        size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
         ssKey.clear();
         ssValue.clear();
     }
@@ -87,8 +144,16 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        // LevelDB serializes erases as:
+        // - byte: header
+        // - varint: key length
+        // - byte[]: key
+        // The formula below assumes the key is less than 16kB.
+        size_estimate += 2 + (slKey.size() > 127) + slKey.size();
         ssKey.clear();
     }
+
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CDBIterator
@@ -164,6 +229,9 @@ private:
     //! database options used
     leveldb::Options options;
 
+    //! keeps a shared block cache alive for as long as the database uses it
+    std::shared_ptr<leveldb::Cache> blockCache;
+
     //! options used when reading from the database
     leveldb::ReadOptions readoptions;
 
@@ -198,8 +266,9 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] dbOptions   LevelDB tuning parameters.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBOptions& dbOptions = CDBOptions());
     ~CDBWrapper();
 
     template <typename K, typename V>
@@ -286,6 +355,23 @@ public:
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    /**
+     * Compact the on-disk representation of the keys in the range
+     * [key_begin, key_end], e.g. after erasing a large part of it.
+     */
+    template<typename K>
+    void CompactRange(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -208,3 +208,93 @@ uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
     SIPROUND;
     return v0 ^ v1 ^ v2 ^ v3;
 }
+
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra)
+{
+    /* Specialized implementation for efficiency */
+    uint64_t d = val.GetUint64(0);
+
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1 ^ d;
+
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(1);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(2);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = val.GetUint64(3);
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    d = (((uint64_t)36) << 56) | extra;
+    v3 ^= d;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= d;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Four interleaved copies of SipHashUint256, one per lane suffix a to d */
+#define SIPROUND_LANE(x, i, w) do { \
+    v0##x += v1##x; v1##x = ROTL(v1##x, 13); v1##x ^= v0##x; \
+    v0##x = ROTL(v0##x, 32); \
+    v2##x += v3##x; v3##x = ROTL(v3##x, 16); v3##x ^= v2##x; \
+    v0##x += v3##x; v3##x = ROTL(v3##x, 21); v3##x ^= v0##x; \
+    v2##x += v1##x; v1##x = ROTL(v1##x, 17); v1##x ^= v2##x; \
+    v2##x = ROTL(v2##x, 32); \
+} while (0)
+#define SIPINIT_LANE(x, i, w) do { \
+    d##x = val[i]->GetUint64(0); \
+    v0##x = 0x736f6d6570736575ULL ^ k0; \
+    v1##x = 0x646f72616e646f6dULL ^ k1; \
+    v2##x = 0x6c7967656e657261ULL ^ k0; \
+    v3##x = 0x7465646279746573ULL ^ k1 ^ d##x; \
+} while (0)
+#define SIPWORD_LANE(x, i, w) do { v0##x ^= d##x; d##x = val[i]->GetUint64(w); v3##x ^= d##x; } while (0)
+#define SIPLENGTH_LANE(x, i, w) do { v0##x ^= d##x; v3##x ^= ((uint64_t)4) << 59; } while (0)
+#define SIPFINAL_LANE(x, i, w) do { v0##x ^= ((uint64_t)4) << 59; v2##x ^= 0xFF; } while (0)
+#define SIPOUT_LANE(x, i, w) do { out[i] = v0##x ^ v1##x ^ v2##x ^ v3##x; } while (0)
+#define FOR_LANES(M, w) do { M(a, 0, w); M(b, 1, w); M(c, 2, w); M(d, 3, w); } while (0)
+
+void SipHashUint256Lanes(uint64_t k0, uint64_t k1, const uint256* const val[SIPHASH_LANES], uint64_t out[SIPHASH_LANES])
+{
+    static_assert(SIPHASH_LANES == 4, "SipHashUint256Lanes is written out for four lanes");
+    uint64_t v0a, v1a, v2a, v3a, da;
+    uint64_t v0b, v1b, v2b, v3b, db;
+    uint64_t v0c, v1c, v2c, v3c, dc;
+    uint64_t v0d, v1d, v2d, v3d, dd;
+
+    FOR_LANES(SIPINIT_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    for (int w = 1; w < 4; w++) {
+        FOR_LANES(SIPWORD_LANE, w);
+        FOR_LANES(SIPROUND_LANE, 0);
+        FOR_LANES(SIPROUND_LANE, 0);
+    }
+    FOR_LANES(SIPLENGTH_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPFINAL_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPROUND_LANE, 0);
+    FOR_LANES(SIPOUT_LANE, 0);
+}
@@ -12,6 +12,7 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "validation.h"
 #include "net.h"
@@ -103,6 +104,8 @@ BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
 
     // Whether we need to account for byte usage (in addition to weight usage)
     fNeedSizeAccounting = (nBlockMaxSize < MAX_BLOCK_SERIALIZED_SIZE-1000);
+
+    nTemplateCheck = GetArg("-blocktemplatecheck", DEFAULT_BLOCK_TEMPLATE_CHECK);
 }
 
 void BlockAssembler::resetBlock()
@@ -134,21 +137,85 @@ void BlockAssembler::resetBlock()
 // nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
 // zero.
 //
-bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
+CHeaderHasher::CHeaderHasher(const CBlockHeader& header)
 {
-    // Write the first 76 bytes of the block header to a double-SHA256 state.
-    CHash256 hasher;
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss << *pblock;
+    ss << header;
     assert(ss.size() == 80);
-    hasher.Write((unsigned char*)&ss[0], 76);
+    midstate.Write((unsigned char*)&ss[0], 64);
+    memcpy(tail, &ss[64], 12);
+}
+
+uint256 CHeaderHasher::GetHash(uint32_t nNonce) const
+{
+    unsigned char buf[16];
+    memcpy(buf, tail, 12);
+    WriteLE32(buf + 12, nNonce);
+    unsigned char hash1[CSHA256::OUTPUT_SIZE];
+    CSHA256(midstate).Write(buf, sizeof(buf)).Finalize(hash1);
+    uint256 hash;
+    CSHA256().Write(hash1, sizeof(hash1)).Finalize(hash.begin());
+    return hash;
+}
+
+bool ScanNonces(CBlockHeader& header, uint64_t nMaxTries, int nThreads, uint64_t& nTried)
+{
+    bool fNegative, fOverflow;
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(header.nBits, &fNegative, &fOverflow);
+    const uint32_t nFirst = header.nNonce;
+    const uint64_t nEnd = std::min(nMaxTries, ((uint64_t)1 << 32) - nFirst);
+    nTried = nEnd;
+    if (fNegative || fOverflow || bnTarget == 0)
+        return false;
+
+    const CHeaderHasher hasher(header);
+    // Offset of the lowest solution found so far, nEnd if none
+    std::atomic<uint64_t> nFound(nEnd);
+    std::atomic<uint64_t> nNext(0);
+    auto scan = [&]() {
+        while (true) {
+            uint64_t nStart = nNext.fetch_add(NONCE_SCAN_CHUNK);
+            if (nStart >= nFound.load())
+                return;
+            uint64_t nStop = std::min(nStart + NONCE_SCAN_CHUNK, nEnd);
+            for (uint64_t i = nStart; i < nStop; i++) {
+                if (UintToArith256(hasher.GetHash(nFirst + i)) <= bnTarget) {
+                    uint64_t nPrev = nFound.load();
+                    while (i < nPrev && !nFound.compare_exchange_weak(nPrev, i)) {}
+                    return;
+                }
+            }
+        }
+    };
+
+    // Starting threads only pays off if a solution takes more than a chunk
+    // of work, which is never the case on regtest.
+    if (nThreads > 1 && nEnd > NONCE_SCAN_CHUNK && bnTarget < (~arith_uint256() / NONCE_SCAN_CHUNK)) {
+        boost::thread_group threads;
+        for (int i = 1; i < nThreads; i++)
+            threads.create_thread(scan);
+        scan();
+        threads.join_all();
+    } else {
+        scan();
+    }
+
+    if (nFound.load() == nEnd)
+        return false;
+    nTried = nFound.load();
+    header.nNonce = nFirst + nTried;
+    return true;
+}
+
+bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
+{
+    const CHeaderHasher hasher(*pblock);
 
     while (true) {
         nNonce++;
 
-        // Write the last 4 bytes of the block header (the nonce) to a copy of
-        // the double-SHA256 state, and compute the result.
-        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
+        *phash = hasher.GetHash(nNonce);
 
         // Return the nonce if the hash has at least some zero bits,
         // caller will check if it has enough to reach the target
@@ -272,6 +339,8 @@ void BlockAssembler::BitcoinMiner()
                     break;
                 if (pindexPrev != chainActive.Tip())
                     break;
+                if (*pblocktemplate->pfCheckFailed)
+                    break;
 
                 // Update nTime every few seconds
                 if (UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev) < 0)
@@ -319,7 +388,54 @@ void BlockAssembler::GenerateBitcoins(bool fGenerate, int nThreads)
         minerThreads->create_thread(boost::bind(&BlockAssembler::BitcoinMiner, this));
 }
 
-std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
+namespace {
+
+CWaitableCriticalSection cs_templateCheck;
+CConditionVariable condTemplateCheck;
+//! Latest template waiting for ThreadCheckBlockTemplates and its failure flag (protected by cs_templateCheck)
+std::shared_ptr<const CBlock> pTemplateToCheck;
+std::shared_ptr<std::atomic<bool> > pfTemplateToCheckFailed;
+
+// Only the latest template is kept: an older one that has not been checked
+// yet has normally been replaced by the time it would be.
+void QueueBlockTemplateCheck(const CBlock& block, const std::shared_ptr<std::atomic<bool> >& pfCheckFailed)
+{
+    boost::unique_lock<boost::mutex> lock(cs_templateCheck);
+    pTemplateToCheck = std::make_shared<const CBlock>(block);
+    pfTemplateToCheckFailed = pfCheckFailed;
+    condTemplateCheck.notify_one();
+}
+
+} // anon namespace
+
+void ThreadCheckBlockTemplates(const CChainParams& chainparams)
+{
+    RenameThread("bitcoin-tmplchk");
+    while (true) {
+        std::shared_ptr<const CBlock> pblock;
+        std::shared_ptr<std::atomic<bool> > pfCheckFailed;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_templateCheck);
+            while (!pTemplateToCheck)
+                condTemplateCheck.wait(lock);
+            pblock.swap(pTemplateToCheck);
+            pfCheckFailed.swap(pfTemplateToCheckFailed);
+        }
+
+        LOCK(cs_main);
+        CBlockIndex* pindexPrev = chainActive.Tip();
+        // A template for an old tip is replaced anyway
+        if (pblock->hashPrevBlock != pindexPrev->GetBlockHash())
+            continue;
+        CValidationState state;
+        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+            *pfCheckFailed = true;
+            LogPrintf("%s: TestBlockValidity failed: %s\n", __func__, FormatStateMessage(state));
+        }
+    }
+}
+
+std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn, const CBlockTemplate* pprevTemplate)
 {
     resetBlock();
 
@@ -359,7 +475,10 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     // transaction (which in most cases can be a no-op).
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
 
-    addPriorityTxs();
+    if (!pprevTemplate || pprevTemplate->block.hashPrevBlock != pindexPrev->GetBlockHash() ||
+        *pprevTemplate->pfCheckFailed || !addPreviousTxs(*pprevTemplate)) {
+        addPriorityTxs();
+    }
     addPackageTxs();
 
     nLastBlockTx = nBlockTx;
@@ -388,9 +507,16 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     pblock->nNonce         = 0;
     pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblock->vtx[0]);
 
-    CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    // The transactions were validated on their way into the mempool, so with
+    // the signature cache the script checks in ConnectBlock are mostly cache
+    // hits; the rest run on the script check threads.
+    if (nTemplateCheck == TEMPLATE_CHECK_FULL) {
+        CValidationState state;
+        if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
+            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+        }
+    } else if (nTemplateCheck == TEMPLATE_CHECK_ASYNC) {
+        QueueBlockTemplateCheck(*pblock, pblocktemplate->pfCheckFailed);
     }
 
     return std::move(pblocktemplate);
@@ -662,6 +788,7 @@ void BlockAssembler::addPackageTxs()
         }
 
         if (!TestPackage(packageSize, packageSigOpsCost)) {
+            pblocktemplate->fSkippedForSpace = true;
             if (fUsingModified) {
                 // Since we always look at the best entry in mapModifiedTx,
                 // we must erase failed entries so that we can consider the
@@ -693,6 +820,10 @@ void BlockAssembler::addPackageTxs()
         vector<CTxMemPool::txiter> sortedEntries;
         SortForBlock(ancestors, iter, sortedEntries);
 
+        CFeeRate packageFeeRate(packageFees, packageSize);
+        if (packageFeeRate < pblocktemplate->minPackageFeeRate)
+            pblocktemplate->minPackageFeeRate = packageFeeRate;
+
         for (size_t i=0; i<sortedEntries.size(); ++i) {
             AddToBlock(sortedEntries[i]);
             // Erase from the modified set, if present
@@ -704,6 +835,51 @@ void BlockAssembler::addPackageTxs()
     }
 }
 
+// Reuse the selection of a template built on the same tip. Transactions
+// that have left the mempool since are dropped together with anything
+// spending them, and addPackageTxs() then fills the space that is left.
+// If the old template had to leave packages out for lack of room, it is only
+// reused when no transaction outside it now has a higher ancestor fee rate
+// than the worst package it contains; otherwise it would keep worse
+// transactions in place of better ones and the caller starts over.
+bool BlockAssembler::addPreviousTxs(const CBlockTemplate& prev)
+{
+    std::set<uint256> setPrevTx;
+    for (size_t i = 1; i < prev.block.vtx.size(); i++) {
+        setPrevTx.insert(prev.block.vtx[i]->GetHash());
+    }
+
+    if (prev.fSkippedForSpace) {
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+        for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi) {
+            if (CFeeRate(mi->GetModFeesWithAncestors(), mi->GetSizeWithAncestors()) <= prev.minPackageFeeRate)
+                break;
+            if (!setPrevTx.count(mi->GetTx().GetHash()))
+                return false;
+        }
+    }
+
+    std::set<uint256> setDropped;
+    for (size_t i = 1; i < prev.block.vtx.size(); i++) {
+        const CTransaction& tx = *prev.block.vtx[i];
+        CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+        bool fKeep = it != mempool.mapTx.end();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (setDropped.count(txin.prevout.hash))
+                fKeep = false;
+        }
+        if (!fKeep || !TestForBlock(it)) {
+            setDropped.insert(tx.GetHash());
+            continue;
+        }
+        AddToBlock(it);
+    }
+    pblocktemplate->minPackageFeeRate = prev.minPackageFeeRate;
+    pblocktemplate->fSkippedForSpace = prev.fSkippedForSpace;
+    LogPrint("bench", "CreateNewBlock(): reused %u of %u transactions from previous template\n", nBlockTx, prev.block.vtx.size() - 1);
+    return true;
+}
+
 void BlockAssembler::addPriorityTxs()
 {
     // How much of the block should be dedicated to high-priority transactions,
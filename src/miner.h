@@ -6,9 +6,11 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "crypto/sha256.h"
 #include "primitives/block.h"
 #include "txmempool.h"
 
+#include <atomic>
 #include <stdint.h>
 #include <memory>
 #include "boost/multi_index_container.hpp"
@@ -26,12 +28,32 @@ static const int DEFAULT_GENERATE_THREADS = 1;
 static const bool DEFAULT_GENERATE = false;
 static const bool DEFAULT_PRINTPRIORITY = false;
 
+/** How CreateNewBlock checks the templates it returns (-blocktemplatecheck) */
+enum BlockTemplateCheck {
+    //! Do not run TestBlockValidity on templates
+    TEMPLATE_CHECK_NONE = 0,
+    //! Return templates right away and check them on a background thread
+    TEMPLATE_CHECK_ASYNC = 1,
+    //! Check templates before returning them
+    TEMPLATE_CHECK_FULL = 2,
+};
+static const int DEFAULT_BLOCK_TEMPLATE_CHECK = TEMPLATE_CHECK_FULL;
+
 struct CBlockTemplate
 {
     CBlock block;
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOpsCost;
     std::vector<unsigned char> vchCoinbaseCommitment;
+    //! Lowest ancestor fee rate among the packages selected for the block
+    CFeeRate minPackageFeeRate;
+    //! Whether a package was left out for lack of room in the block
+    bool fSkippedForSpace;
+
+    //! Set when a background check (TEMPLATE_CHECK_ASYNC) finds the template invalid
+    std::shared_ptr<std::atomic<bool> > pfCheckFailed;
+
+    CBlockTemplate() : minPackageFeeRate(MAX_MONEY), fSkippedForSpace(false), pfCheckFailed(std::make_shared<std::atomic<bool> >(false)) {}
 };
 
 // Container for tracking updates to ancestor feerate as we include (parent)
@@ -158,6 +180,7 @@ private:
     int nHeight;
     int64_t nLockTimeCutoff;
     const CChainParams& chainparams;
+    int nTemplateCheck;
 
     // Variables used for addPriorityTxs
     int lastFewTxs;
@@ -169,8 +192,12 @@ public:
     void BitcoinMiner();
     /** Run the miner threads */
     void GenerateBitcoins(bool fGenerate, int nThreads);
-    /** Construct a new block template with coinbase to scriptPubKeyIn */
-    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn);
+    /** Construct a new block template with coinbase to scriptPubKeyIn.
+     *  If pprevTemplate was built on the current tip, its transactions that
+     *  are still in the mempool are kept and only the remaining space is
+     *  filled, unless better-paying transactions have arrived that it would
+     *  have to make room for. */
+    std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, const CBlockTemplate* pprevTemplate = NULL);
 
 private:
     // utility functions
@@ -184,6 +211,8 @@ private:
     void addPriorityTxs();
     /** Add transactions based on feerate including unconfirmed ancestors */
     void addPackageTxs();
+    /** Add the transactions of a template for the same tip, if it can be reused */
+    bool addPreviousTxs(const CBlockTemplate& prev);
 
     // helper function for addPriorityTxs
     /** Test if tx will still "fit" in the block */
@@ -211,6 +240,37 @@ private:
     void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
 };
 
+/**
+ * Hashes block headers that differ only in nNonce. The SHA-256 state after
+ * the first 64 header bytes is computed once, so each nonce costs one
+ * compression for the header tail plus the second SHA-256.
+ */
+class CHeaderHasher
+{
+private:
+    CSHA256 midstate;
+    unsigned char tail[16];
+
+public:
+    explicit CHeaderHasher(const CBlockHeader& header);
+    uint256 GetHash(uint32_t nNonce) const;
+};
+
+/** Number of nonces a nonce search thread claims at a time */
+static const uint32_t NONCE_SCAN_CHUNK = 4096;
+
+/**
+ * Search up to nMaxTries nonces, starting at header.nNonce, for a header
+ * hash that meets header.nBits. Threads claim chunks of the range from a
+ * shared counter; the lowest solution wins, so the result does not depend
+ * on nThreads. On success header.nNonce is set to the solution. nTried is
+ * set to the number of nonces before the solution, or the number searched.
+ */
+bool ScanNonces(CBlockHeader& header, uint64_t nMaxTries, int nThreads, uint64_t& nTried);
+
+/** Check templates created with TEMPLATE_CHECK_ASYNC, latest first */
+void ThreadCheckBlockTemplates(const CChainParams& chainparams);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -46,6 +46,27 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// Longest time (ms) a socket thread waits for readiness, and the interval
+// (ms) at which it disconnects nodes and checks for timeouts.
+#define SOCKET_WAIT_TIMEOUT 50
+#define SOCKET_HOUSEKEEPING_INTERVAL 50
+
+#ifdef USE_EPOLL
+// Maximum number of events taken from epoll_wait at once
+static const int MAX_SOCKET_EVENTS = 256;
+// epoll event data of listening sockets; node events carry the node id
+static const uint64_t LISTEN_SOCKET_EVENT = std::numeric_limits<uint64_t>::max();
+#endif
+
+#ifndef WIN32
+// Maximum number of buffers (two per queued message) passed to one sendmsg() call
+static const int MAX_SEND_IOV = 64;
+#endif
+
+// Largest receive buffer kept for reuse, and the most memory kept that way
+static const size_t MAX_POOLED_RECV_BUFFER = 512 * 1024;
+static const size_t MAX_RECV_BUFFER_POOL = 16 * 1024 * 1024;
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -76,6 +97,7 @@ std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfLimited[NET_MAX] = {};
 std::string strSubVersion;
 
+CCriticalSection cs_mapAlreadyAskedFor;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 // Signals for message handling
@@ -396,10 +418,7 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool fCo
         pnode->nTimeConnected = GetTime();
         pnode->AddRef();
         GetNodeSignals().InitializeNode(pnode, *this);
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+        RegisterNode(pnode);
 
         return pnode;
     } else if (!proxyConnectionFailed) {
@@ -660,7 +679,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -700,22 +719,82 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
     return true;
 }
 
+namespace {
+/**
+ * Receive buffers of messages that have been processed. They are handed to
+ * new messages, so that receiving does not allocate (and zero on release) a
+ * fresh buffer for every message.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CDataStream> vBuffers;
+    size_t nBytes;
+
+public:
+    CRecvBufferPool() : nBytes(0) {}
+
+    CDataStream Get(int nType, int nVersion)
+    {
+        LOCK(cs);
+        if (vBuffers.empty())
+            return CDataStream(nType, nVersion);
+        CDataStream buffer(std::move(vBuffers.back()));
+        vBuffers.pop_back();
+        nBytes -= buffer.capacity();
+        buffer.SetType(nType);
+        buffer.SetVersion(nVersion);
+        return buffer;
+    }
+
+    void Put(CDataStream& buffer)
+    {
+        // Large buffers (blocks) are rare; let them go.
+        size_t nCapacity = buffer.capacity();
+        if (nCapacity == 0 || nCapacity > MAX_POOLED_RECV_BUFFER)
+            return;
+        LOCK(cs);
+        if (nBytes + nCapacity > MAX_RECV_BUFFER_POOL)
+            return;
+        buffer.clear();
+        nBytes += nCapacity;
+        vBuffers.push_back(std::move(buffer));
+    }
+};
+
+CRecvBufferPool recvBufferPool;
+}
+
+CNetMessage::CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(recvBufferPool.Get(nTypeIn, nVersionIn))
+{
+    in_data = false;
+    nHdrPos = 0;
+    nDataPos = 0;
+    nTime = 0;
+}
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Put(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    // the header is collected at the start of the message buffer
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
+    // deserialize to CMessageHeader, which leaves vRecv empty for the data
     try {
-        hdrbuf >> hdr;
+        vRecv >> hdr;
     }
     catch (const std::exception&) {
         return -1;
@@ -736,13 +815,14 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.capacity() < nDataPos + nCopy) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        vRecv.reserve(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
     }
 
+    // The checksum is computed while the data arrives
     hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -764,6 +844,19 @@ const uint256& CNetMessage::GetMessageHash() const
 
 
 
+// Get the unsent part of a queued message that starts at nOffset and is contiguous in memory
+static void GetSendBuffer(const CQueuedNetMsg& msg, size_t nOffset, const unsigned char*& pch, size_t& nLen)
+{
+    if (nOffset < CMessageHeader::HEADER_SIZE) {
+        pch = msg.header + nOffset;
+        nLen = CMessageHeader::HEADER_SIZE - nOffset;
+    } else {
+        nOffset -= CMessageHeader::HEADER_SIZE;
+        pch = msg.payload->data.data() + nOffset;
+        nLen = msg.payload->data.size() - nOffset;
+    }
+}
+
 // requires LOCK(cs_vSend)
 size_t SocketSendData(CNode *pnode)
 {
@@ -771,20 +864,55 @@ size_t SocketSendData(CNode *pnode)
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert(it->size() > pnode->nSendOffset);
+        size_t nAttempt = 0;
+#ifdef WIN32
+        const unsigned char* pch;
+        GetSendBuffer(*it, pnode->nSendOffset, pch, nAttempt);
+        int nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(pch), nAttempt, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued buffers as fit into one sendmsg() call
+        struct iovec vIov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (auto itIov = it; itIov != pnode->vSendMsg.end() && nIov + 2 <= MAX_SEND_IOV; ++itIov) {
+            while (nOffset < itIov->size()) {
+                const unsigned char* pch;
+                size_t nLen;
+                GetSendBuffer(*itIov, nOffset, pch, nLen);
+                vIov[nIov].iov_base = const_cast<unsigned char*>(pch);
+                vIov[nIov].iov_len = nLen;
+                nIov++;
+                nOffset += nLen;
+                nAttempt += nLen;
+            }
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that were sent completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = it->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nAttempt) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -1033,291 +1161,467 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
-    {
-        LOCK(cs_vNodes);
-        vNodes.push_back(pnode);
+    RegisterNode(pnode);
+}
+
+void CConnman::RegisterNode(CNode* pnode)
+{
+    LOCK(cs_vNodes);
+    vNodes.push_back(pnode);
+    if (vSocketThreads.empty())
+        return;
+    // Spread nodes evenly over the socket threads.
+    pnode->nSocketThread = pnode->GetId() % vSocketThreads.size();
+    SocketThread& thread = vSocketThreads[pnode->nSocketThread];
+    thread.mapNodes[pnode->GetId()] = pnode;
+#ifdef USE_EPOLL
+    // Edge-triggered: the socket thread remembers readiness in fRecvReady/fSendReady
+    // until it has read or written until the socket would block.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = pnode->GetId();
+    if (epoll_ctl(thread.hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        pnode->fDisconnect = true;
     }
+#endif
 }
 
-void CConnman::ThreadSocketHandler()
+void CConnman::DisconnectNodes(int nThread)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    SocketThread& thread = vSocketThreads[nThread];
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->nSocketThread != nThread)
+                continue;
+            if (!pnode->fDisconnect)
+                InactivityCheck(pnode);
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                thread.mapNodes.erase(pnode->GetId());
+                thread.setPending.erase(pnode);
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                pnode->Release();
+                thread.vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = thread.vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        DeleteNode(pnode);
-                    }
+                }
+                if (fDelete)
+                {
+                    thread.vNodesDisconnected.remove(pnode);
+                    DeleteNode(pnode);
                 }
             }
         }
-        size_t vNodesSize;
+    }
+}
+
+void CConnman::NotifyNumConnectionsChanged(unsigned int& nPrevNodeCount)
+{
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        if(clientInterface)
+            clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
         {
-            LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            if(clientInterface)
-                clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+bool CConnman::SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        bool notify = false;
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+            pnode->CloseSocketDisconnect();
+        if(notify)
+            messageHandlerCondition.notify_one();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
 
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+void CConnman::ThreadSocketHandler(int nThread)
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+    while (true)
+    {
+        // Disconnect and delete nodes, and check for timeouts. With many peers
+        // this is the only work that scales with the number of connections
+        // rather than with their activity, so it is not done on every wakeup.
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastHousekeeping >= SOCKET_HOUSEKEEPING_INTERVAL)
+        {
+            nLastHousekeeping = nNow;
+            DisconnectNodes(nThread);
+            if (nThread == 0)
+                NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+#ifdef USE_EPOLL
+        SocketEventsEpoll(nThread);
+#else
+        SocketEventsSelect();
+#endif
+    }
+}
+
+#ifdef USE_EPOLL
+void CConnman::SocketEventsEpoll(int nThread)
+{
+    SocketThread& thread = vSocketThreads[nThread];
+
+    // Only sleep the full interval if all left over readiness is waiting for
+    // the message handler (receive buffer full) or for a pending send.
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(thread.hEpoll, events, MAX_SOCKET_EVENTS, thread.fRetry ? 0 : SOCKET_WAIT_TIMEOUT);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        if (!pnode->vSendMsg.empty()) {
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                            continue;
-                        }
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+            MilliSleep(SOCKET_WAIT_TIMEOUT);
+        }
+        nEvents = 0;
+    }
+
+    bool fAccept = false;
+    {
+        LOCK(cs_vNodes);
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.u64 == LISTEN_SOCKET_EVENT) {
+                fAccept = true;
+                continue;
             }
+            // Look the node up by id: a stale event must not reach a deleted node.
+            std::map<NodeId, CNode*>::iterator it = thread.mapNodes.find(events[i].data.u64);
+            if (it == thread.mapNodes.end())
+                continue;
+            CNode* pnode = it->second;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+            thread.setPending.insert(pnode);
+        }
+    }
+
+    //
+    // Accept new connections
+    //
+    if (fAccept)
+    {
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        {
+            if (hListenSocket.socket != INVALID_SOCKET)
+                AcceptConnection(hListenSocket);
         }
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    //
+    // Service each socket with outstanding readiness
+    //
+    thread.fRetry = false;
+    std::set<CNode*>::iterator it = thread.setPending.begin();
+    while (it != thread.setPending.end())
+    {
         boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
+        CNode* pnode = *it;
+        if (pnode->hSocket == INVALID_SOCKET)
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            pnode->fRecvReady = false;
+            pnode->fSendReady = false;
         }
 
         //
-        // Accept new connections
+        // Send
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (pnode->fSendReady)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                // If data remains queued afterwards, the socket buffer is
+                // full and a new EPOLLOUT edge will follow.
+                if (!pnode->vSendMsg.empty()) {
+                    size_t nBytes = SocketSendData(pnode);
+                    if (nBytes)
+                        RecordBytesSent(nBytes);
+                }
+                pnode->fSendReady = false;
+            } else {
+                thread.fRetry = true;
             }
         }
 
         //
-        // Service each socket
+        // Receive
         //
-        std::vector<CNode*> vNodesCopy;
+        // As with select(), drain the send queue before receiving more, and
+        // stop reading while a complete message exceeds the receive buffer.
+        if (pnode->fRecvReady && pnode->nSendSize == 0)
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv) {
+                while (pnode->fRecvReady && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
+                    pnode->fRecvReady = SocketRecvData(pnode);
+            } else {
+                thread.fRetry = true;
+            }
         }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            bool notify = false;
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                                pnode->CloseSocketDisconnect();
-                            if(notify)
-                                messageHandlerCondition.notify_one();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+        if (!pnode->fRecvReady && !pnode->fSendReady)
+            thread.setPending.erase(it++);
+        else
+            ++it;
+    }
+}
+#else
+void CConnman::SocketEventsSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_WAIT_TIMEOUT * 1000; // frequency to poll pnode->vSend
 
-            //
-            // Send
-            //
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend) {
-                    size_t nBytes = SocketSendData(pnode);
-                    if (nBytes)
-                        RecordBytesSent(nBytes);
+                    if (!pnode->vSendMsg.empty()) {
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                        continue;
+                    }
                 }
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= GetReceiveFloodSize()))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode);
+        }
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend) {
+                size_t nBytes = SocketSendData(pnode);
+                if (nBytes)
+                    RecordBytesSent(nBytes);
+            }
         }
     }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
 }
+#endif
+
 
 
 
@@ -1820,11 +2124,8 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
 }
 
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(int nThread)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     while (true)
     {
         std::vector<CNode*> vNodesCopy;
@@ -1835,6 +2136,9 @@ void CConnman::ThreadMessageHandler()
                 pnode->AddRef();
             }
         }
+        // Start at a different node in each thread, so that they don't all
+        // contend for the same nodes.
+        std::rotate(vNodesCopy.begin(), vNodesCopy.begin() + nThread * vNodesCopy.size() / nMessageHandlerThreads, vNodesCopy.end());
 
         bool fSleep = true;
 
@@ -1843,6 +2147,11 @@ void CConnman::ThreadMessageHandler()
             if (pnode->fDisconnect)
                 continue;
 
+            // Skip nodes that another handler thread is busy with
+            TRY_LOCK(pnode->cs_msgProcessing, lockProcessing);
+            if (!lockProcessing)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1877,8 +2186,10 @@ void CConnman::ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -2065,6 +2376,8 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) : nSeed0(nSeed0In), nSe
     nLastNodeId = 0;
     nSendBufferMaxSize = 0;
     nReceiveFloodSize = 0;
+    nNetworkThreads = 0;
+    nMessageHandlerThreads = 0;
     semOutbound = NULL;
     nMaxConnections = 0;
     nMaxOutbound = 0;
@@ -2092,6 +2405,12 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
 
     nSendBufferMaxSize = connOptions.nSendBufferMaxSize;
     nReceiveFloodSize = connOptions.nSendBufferMaxSize;
+#ifdef USE_EPOLL
+    nNetworkThreads = std::max(connOptions.nNetworkThreads, 1);
+#else
+    nNetworkThreads = 1;
+#endif
+    nMessageHandlerThreads = std::max(connOptions.nMessageHandlerThreads, 1);
 
     nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
     nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
@@ -2150,8 +2469,33 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
     else
         threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "dnsseed", boost::function<void()>(boost::bind(&CConnman::ThreadDNSAddressSeed, this))));
 
-    // Send and receive from sockets, accept connections
-    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "net", boost::function<void()>(boost::bind(&CConnman::ThreadSocketHandler, this))));
+    // Send and receive from sockets, accept connections. Each node is served
+    // by one socket thread; the first one also accepts new connections.
+    vSocketThreads.resize(nNetworkThreads);
+    for (int i = 0; i < nNetworkThreads; i++) {
+        SocketThread& thread = vSocketThreads[i];
+        thread.strName = i == 0 ? "net" : strprintf("net%d", i);
+#ifdef USE_EPOLL
+        thread.hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (thread.hEpoll == -1) {
+            strNodeError = strprintf("Failed to create epoll instance: %s", NetworkErrorString(WSAGetLastError()));
+            return false;
+        }
+#endif
+    }
+#ifdef USE_EPOLL
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = LISTEN_SOCKET_EVENT;
+        if (epoll_ctl(vSocketThreads[0].hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+            strNodeError = strprintf("Failed to watch listening socket: %s", NetworkErrorString(WSAGetLastError()));
+            return false;
+        }
+    }
+#endif
+    for (int i = 0; i < nNetworkThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, vSocketThreads[i].strName.c_str(), boost::function<void()>(boost::bind(&CConnman::ThreadSocketHandler, this, i))));
 
     // Initiate outbound connections from -addnode
     threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "addcon", boost::function<void()>(boost::bind(&CConnman::ThreadOpenAddedConnections, this))));
@@ -2160,8 +2504,13 @@ bool CConnman::Start(boost::thread_group& threadGroup, CScheduler& scheduler, st
     if (!mapArgs.count("-connect") || mapMultiArgs["-connect"].size() != 1 || mapMultiArgs["-connect"][0] != "0")
         threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "opencon", boost::function<void()>(boost::bind(&CConnman::ThreadOpenConnections, this))));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this))));
+    // Process messages. A node is handled by one thread at a time, so its
+    // messages are still processed in order.
+    vMessageHandlerNames.clear();
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        vMessageHandlerNames.push_back(i == 0 ? "msghand" : strprintf("msghand%d", i));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, vMessageHandlerNames[i].c_str(), boost::function<void()>(boost::bind(&CConnman::ThreadMessageHandler, this, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
@@ -2210,11 +2559,17 @@ void CConnman::Stop()
     BOOST_FOREACH(CNode *pnode, vNodes) {
         DeleteNode(pnode);
     }
-    BOOST_FOREACH(CNode *pnode, vNodesDisconnected) {
-        DeleteNode(pnode);
+    BOOST_FOREACH(SocketThread& thread, vSocketThreads) {
+        BOOST_FOREACH(CNode *pnode, thread.vNodesDisconnected) {
+            DeleteNode(pnode);
+        }
+#ifdef USE_EPOLL
+        if (thread.hEpoll != -1)
+            close(thread.hEpoll);
+#endif
     }
     vNodes.clear();
-    vNodesDisconnected.clear();
+    vSocketThreads.clear();
     vhListenSocket.clear();
     delete semOutbound;
     semOutbound = NULL;
@@ -2505,6 +2860,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nServices = NODE_NONE;
     nServicesExpected = NODE_NONE;
     hSocket = hSocketIn;
+    nSocketThread = 0;
+    fRecvReady = false;
+    fSendReady = false;
     nRecvVersion = INIT_PROTO_VERSION;
     nLastSend = 0;
     nLastRecv = 0;
@@ -2575,6 +2933,7 @@ void CNode::AskFor(const CInv& inv)
 
     // We're using mapAskFor as a priority queue,
     // the key is the earliest time the request can be sent
+    LOCK(cs_mapAlreadyAskedFor);
     int64_t nRequestTime;
     limitedmap<uint256, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv.hash);
     if (it != mapAlreadyAskedFor.end())
@@ -2599,19 +2958,28 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+CNetMsgPayloadRef MakeNetMsgPayload(std::vector<unsigned char>&& data)
+{
+    std::shared_ptr<CNetMsgPayload> payload = std::make_shared<CNetMsgPayload>();
+    payload->data = std::move(data);
+    payload->hash = Hash(payload->data.begin(), payload->data.end());
+    return payload;
+}
+
 void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
 {
-    size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
+    CQueuedNetMsg queued;
+    queued.payload = msg.payload ? std::move(msg.payload) : MakeNetMsgPayload(std::move(msg.data));
+    size_t nMessageSize = queued.payload->data.size();
+    size_t nTotalSize = queued.size();
     LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->id);
 
-    std::vector<unsigned char> serializedHeader;
-    serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
     CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
-    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
-
-    CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    memcpy(hdr.pchChecksum, queued.payload->hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ssHeader(SER_NETWORK, INIT_PROTO_VERSION);
+    ssHeader << hdr;
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(queued.header, &ssHeader[0], CMessageHeader::HEADER_SIZE);
 
     size_t nBytesSent = 0;
     {
@@ -2625,9 +2993,7 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
         pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
         pnode->nSendSize += nTotalSize;
 
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendMsg.push_back(std::move(queued));
 
         // If write queue empty, attempt "optimistic write"
         if (optimisticSend == true)
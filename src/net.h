@@ -22,6 +22,8 @@
 
 #include <atomic>
 #include <deque>
+#include <list>
+#include <set>
 #include <stdint.h>
 #include <memory>
 
@@ -81,6 +83,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -networkthreads default (only used with epoll; select() is always served by one thread) */
+static const int DEFAULT_NETWORK_THREADS = 2;
+/** -messagethreads default */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 2;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
@@ -101,6 +107,20 @@ class CTransaction;
 class CNodeStats;
 class CClientUIInterface;
 
+/**
+ * Serialized message payload together with its hash. Once built it is never
+ * modified, so the same payload can be queued for any number of peers
+ * without being copied or hashed again.
+ */
+struct CNetMsgPayload
+{
+    std::vector<unsigned char> data;
+    uint256 hash; // double SHA256 of data; its first bytes are the header checksum
+};
+typedef std::shared_ptr<const CNetMsgPayload> CNetMsgPayloadRef;
+
+CNetMsgPayloadRef MakeNetMsgPayload(std::vector<unsigned char>&& data);
+
 struct CSerializedNetMsg
 {
     CSerializedNetMsg() = default;
@@ -111,9 +131,20 @@ struct CSerializedNetMsg
     CSerializedNetMsg& operator=(const CSerializedNetMsg&) = delete;
 
     std::vector<unsigned char> data;
+    //! When set, sent instead of data
+    CNetMsgPayloadRef payload;
     std::string command;
 };
 
+/** A message in a node's send queue */
+struct CQueuedNetMsg
+{
+    unsigned char header[CMessageHeader::HEADER_SIZE];
+    CNetMsgPayloadRef payload;
+
+    size_t size() const { return CMessageHeader::HEADER_SIZE + payload->data.size(); }
+};
+
 
 class CConnman
 {
@@ -137,6 +168,8 @@ public:
         CClientUIInterface* uiInterface = nullptr;
         unsigned int nSendBufferMaxSize = 0;
         unsigned int nReceiveFloodSize = 0;
+        int nNetworkThreads = 1;
+        int nMessageHandlerThreads = 1;
         uint64_t nMaxOutboundTimeframe = 0;
         uint64_t nMaxOutboundLimit = 0;
     };
@@ -337,9 +370,44 @@ private:
     void ThreadOpenAddedConnections();
     void ProcessOneShot();
     void ThreadOpenConnections();
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(int nThread);
+    /** State of one socket handler thread. Only that thread touches it while running. */
+    struct SocketThread
+    {
+        //! Nodes with readiness that has not been acted on yet, e.g. because receiving is paused
+        std::set<CNode*> setPending;
+        //! Nodes of this thread that were disconnected but are still referenced
+        std::list<CNode*> vNodesDisconnected;
+        //! Nodes served by this thread by id (protected by cs_vNodes)
+        std::map<NodeId, CNode*> mapNodes;
+        //! Whether some readiness could not be acted on because a lock was busy
+        bool fRetry;
+        std::string strName;
+#ifdef USE_EPOLL
+        int hEpoll;
+#endif
+
+        SocketThread() : fRetry(false)
+#ifdef USE_EPOLL
+            , hEpoll(-1)
+#endif
+        {}
+    };
+
     void AcceptConnection(const ListenSocket& hListenSocket);
-    void ThreadSocketHandler();
+    //! Add a new node to vNodes and assign it to a socket thread
+    void RegisterNode(CNode* pnode);
+    void DisconnectNodes(int nThread);
+    void NotifyNumConnectionsChanged(unsigned int& nPrevNodeCount);
+    void InactivityCheck(CNode* pnode);
+    //! Read once from the node's socket; returns whether there may be more to read
+    bool SocketRecvData(CNode* pnode);
+    void ThreadSocketHandler(int nThread);
+#ifdef USE_EPOLL
+    void SocketEventsEpoll(int nThread);
+#else
+    void SocketEventsSelect();
+#endif
     void ThreadDNSAddressSeed();
 
     uint64_t CalculateKeyedNetGroup(const CAddress& ad);
@@ -392,6 +460,9 @@ private:
 
     unsigned int nSendBufferMaxSize;
     unsigned int nReceiveFloodSize;
+    int nNetworkThreads;
+    int nMessageHandlerThreads;
+    std::vector<std::string> vMessageHandlerNames;
 
     std::vector<ListenSocket> vhListenSocket;
     std::atomic<bool> fNetworkActive;
@@ -405,10 +476,11 @@ private:
     std::vector<std::string> vAddedNodes;
     CCriticalSection cs_vAddedNodes;
     std::vector<CNode*> vNodes;
-    std::list<CNode*> vNodesDisconnected;
     mutable CCriticalSection cs_vNodes;
+    std::vector<SocketThread> vSocketThreads;
     std::atomic<NodeId> nLastNodeId;
     boost::condition_variable messageHandlerCondition;
+    boost::mutex mutexMessageHandler;
 
     /** Services this instance offers */
     ServiceFlags nLocalServices;
@@ -492,7 +564,8 @@ extern bool fDiscover;
 extern bool fListen;
 extern bool fRelayTxes;
 
-extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
+extern CCriticalSection cs_mapAlreadyAskedFor;
+extern limitedmap<uint256, int64_t> mapAlreadyAskedFor; // protected by cs_mapAlreadyAskedFor
 
 /** Subversion as sent to the P2P network in `version` messages */
 extern std::string strSubVersion;
@@ -543,22 +616,19 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // partially received header, then received message data
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
-        in_data = false;
-        nHdrPos = 0;
-        nDataPos = 0;
-        nTime = 0;
-    }
+    //! vRecv is taken from a pool of buffers released by earlier messages
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn);
+    ~CNetMessage();
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
 
     bool complete() const
     {
@@ -571,7 +641,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -589,15 +658,23 @@ public:
     ServiceFlags nServices;
     ServiceFlags nServicesExpected;
     SOCKET hSocket;
+    //! Socket handler thread that services this node
+    int nSocketThread;
+    //! Readiness reported by the socket thread's poller and not acted on yet (only used by that thread)
+    bool fRecvReady;
+    bool fSendReady;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<CQueuedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    //! Held by the message handler thread that is processing this node, so
+    //! that its messages are handled one at a time and in order
+    CCriticalSection cs_msgProcessing;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -644,8 +721,9 @@ public:
     int nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend; // protected by cs_addrSend
+    CRollingBloomFilter addrKnown; // protected by cs_addrSend
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -781,6 +859,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -789,6 +868,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.rand32() % vAddrToSend.size()] = _addr;
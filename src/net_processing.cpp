@@ -32,6 +32,8 @@
 
 #include <boost/thread.hpp>
 
+#include <unordered_map>
+
 using namespace std;
 
 #if defined(NDEBUG)
@@ -55,9 +57,11 @@ struct COrphanTx {
     NodeId fromPeer;
     int64_t nTimeExpire;
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+/** Protects the orphan pool. May be taken while holding cs_main, but not the other way around. */
+CCriticalSection cs_orphans;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_orphans);
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_orphans);
+void EraseOrphansFor(NodeId peer);
 
 static const uint64_t RANDOMIZER_ID_ADDRESS_RELAY = 0x3cac0035b5866b90ULL; // SHA256("main address relay")[0:8]
 
@@ -79,7 +83,7 @@ namespace {
      * Filter for transactions that were recently rejected by
      * AcceptToMemoryPool. These are not rerequested until the chain tip
      * changes, at which point the entire filter is reset. Protected by
-     * cs_main.
+     * cs_recentRejects.
      *
      * Without this filter we'd be re-requesting txs from each of our peers,
      * increasing bandwidth consumption considerably. For instance, with 100
@@ -95,8 +99,18 @@ namespace {
      *
      * Memory used: 1.3 MB
      */
-    std::unique_ptr<CRollingBloomFilter> recentRejects;
-    uint256 hashRecentRejectsChainTip;
+    CCriticalSection cs_recentRejects;
+    std::unique_ptr<CRollingBloomFilter> recentRejects; // protected by cs_recentRejects
+
+    /**
+     * Filter for transactions that were recently included in a block, so
+     * that announcements of them are ignored without consulting the coins
+     * cache (which needs cs_main). It is reset when blocks are disconnected.
+     */
+    CCriticalSection cs_recentConfirmed;
+    std::unique_ptr<CRollingBloomFilter> recentConfirmed; // protected by cs_recentConfirmed
+    //! Tip the filter was last updated for (protected by cs_recentConfirmed)
+    const CBlockIndex* pindexRecentConfirmedTip = NULL;
 
     /** Blocks that are in flight, and that are in the queue to be downloaded. Protected by cs_main. */
     struct QueuedBlock {
@@ -116,11 +130,45 @@ namespace {
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
 
-    /** Relay map, protected by cs_main. */
+    /**
+     * Transactions recently announced to peers, kept for a while so that
+     * getdata requests for them can be answered after they left the
+     * mempool. The relay map is split by txid into shards that each have
+     * their own lock, so that lookups need no cs_main and peers rarely
+     * contend with each other.
+     */
     typedef std::map<uint256, CTransactionRef> MapRelay;
-    MapRelay mapRelay;
-    /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
-    std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+    struct CRelayShard
+    {
+        CCriticalSection cs;
+        MapRelay mapRelay; // protected by cs
+        //! Expiration-time ordered list of (expire time, relay map entry) pairs (protected by cs)
+        std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+    };
+    static const unsigned int RELAY_SHARDS = 16;
+    CRelayShard relayShards[RELAY_SHARDS];
+
+    CRelayShard& GetRelayShard(const uint256& hash)
+    {
+        return relayShards[hash.GetCheapHash() % RELAY_SHARDS];
+    }
+
+    /**
+     * Serialized compact block announcement of hashCmpctAnnounced, without
+     * and with witnesses, so that it is built once rather than for every
+     * high-bandwidth peer. Protected by cs_main.
+     */
+    uint256 hashCmpctAnnounced;
+    CNetMsgPayloadRef cmpctAnnounced[2];
+
+    /**
+     * Serialized copy of a recent block that was requested with getdata,
+     * without and with witnesses. A new block is typically requested by many
+     * peers at about the same time.
+     */
+    CCriticalSection cs_recentBlock;
+    uint256 hashRecentBlock; // protected by cs_recentBlock
+    CNetMsgPayloadRef recentBlock[2]; // protected by cs_recentBlock
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -441,25 +489,6 @@ bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
     return false;
 }
 
-/** Find the last common ancestor two blocks have.
- *  Both pa and pb must be non-NULL. */
-CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
-    if (pa->nHeight > pb->nHeight) {
-        pa = pa->GetAncestor(pb->nHeight);
-    } else if (pb->nHeight > pa->nHeight) {
-        pb = pb->GetAncestor(pa->nHeight);
-    }
-
-    while (pa != pb && pa && pb) {
-        pa = pa->pprev;
-        pb = pb->pprev;
-    }
-
-    // Eventually all chain branches meet at the genesis block.
-    assert(pa == pb);
-    return pa;
-}
-
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
  *  at most count entries. */
 void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
@@ -586,8 +615,9 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
+    LOCK(cs_orphans);
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -617,7 +647,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     return true;
 }
 
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_orphans)
 {
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
@@ -637,6 +667,7 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
 void EraseOrphansFor(NodeId peer)
 {
+    LOCK(cs_orphans);
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -651,8 +682,9 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
+    LOCK(cs_orphans);
     unsigned int nEvicted = 0;
     static int64_t nNextSweep;
     int64_t nNow = GetTime();
@@ -722,13 +754,19 @@ void Misbehaving(NodeId pnode, int howmuch)
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn) : connman(connmanIn) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    recentConfirmed.reset(new CRollingBloomFilter(48000, 0.000001));
 }
 
 void PeerLogicValidation::SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, int nPosInBlock) {
     if (nPosInBlock == CMainSignals::SYNC_TRANSACTION_NOT_IN_BLOCK)
         return;
 
-    LOCK(cs_main);
+    {
+        LOCK(cs_recentConfirmed);
+        recentConfirmed->insert(tx.GetHash());
+    }
+
+    LOCK(cs_orphans);
 
     std::vector<uint256> vOrphanErase;
     // Which orphan pool entries must we evict?
@@ -756,6 +794,22 @@ void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex *pindexNew, const CB
     const int nNewHeight = pindexNew->nHeight;
     connman->SetBestHeight(nNewHeight);
 
+    {
+        // If the chain tip has changed previously rejected transactions
+        // might be now valid, e.g. due to a nLockTime'd tx becoming valid,
+        // or a double-spend. Reset the rejects filter and give those
+        // txs a second chance.
+        LOCK(cs_recentRejects);
+        recentRejects->reset();
+    }
+    {
+        // Transactions of disconnected blocks are no longer confirmed
+        LOCK(cs_recentConfirmed);
+        if (pindexRecentConfirmedTip != NULL && pindexFork != pindexRecentConfirmedTip)
+            recentConfirmed->reset();
+        pindexRecentConfirmedTip = pindexNew;
+    }
+
     if (!fInitialDownload) {
         // Find the hashes of all blocks that weren't previously in the best chain.
         std::vector<uint256> vHashes;
@@ -808,30 +862,31 @@ void PeerLogicValidation::BlockChecked(const CBlock& block, const CValidationSta
 //
 
 
-bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+// Transactions are looked up without cs_main; for blocks the caller must hold it.
+bool static AlreadyHave(const CInv& inv)
 {
     switch (inv.type)
     {
     case MSG_TX:
     case MSG_WITNESS_TX:
         {
-            assert(recentRejects);
-            if (chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip)
             {
-                // If the chain tip has changed previously rejected transactions
-                // might be now valid, e.g. due to a nLockTime'd tx becoming valid,
-                // or a double-spend. Reset the rejects filter and give those
-                // txs a second chance.
-                hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
-                recentRejects->reset();
+                LOCK(cs_recentRejects);
+                assert(recentRejects);
+                if (recentRejects->contains(inv.hash))
+                    return true;
             }
-
-            // Use pcoinsTip->HaveCoinsInCache as a quick approximation to exclude
-            // requesting or processing some txs which have already been included in a block
-            return recentRejects->contains(inv.hash) ||
-                   mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoinsInCache(inv.hash);
+            {
+                // Quick approximation to exclude requesting or processing
+                // some txs which have already been included in a block
+                LOCK(cs_recentConfirmed);
+                if (recentConfirmed->contains(inv.hash))
+                    return true;
+            }
+            if (mempool.exists(inv.hash))
+                return true;
+            LOCK(cs_orphans);
+            return mapOrphanTransactions.count(inv.hash);
         }
     case MSG_BLOCK:
     case MSG_WITNESS_BLOCK:
@@ -892,7 +947,18 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     unsigned int nMaxSendBufferSize = connman.GetSendBufferSize();
     vector<CInv> vNotFound;
     CNetMsgMaker msgMaker(pfrom->GetSendVersion());
-    LOCK(cs_main);
+
+    // At most one block is served per call. What to send is decided under
+    // cs_main, but the block itself is read from disk after releasing it.
+    // Transactions are served from the relay shards and the mempool, which
+    // do not need cs_main.
+    bool fSendBlock = false;
+    CInv invBlock;
+    CDiskBlockPos posBlock;
+    bool fPeerWantsWitness = false;
+    bool fNearTip = false;
+    bool fCanDirectFetch = false;
+    uint256 hashContinueTip;
 
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -906,6 +972,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK)
             {
+                LOCK(cs_main);
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
@@ -940,64 +1007,18 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
-                    else if (inv.type == MSG_WITNESS_BLOCK)
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, block));
-                    else if (inv.type == MSG_FILTERED_BLOCK)
-                    {
-                        bool sendMerkleBlock = false;
-                        CMerkleBlock merkleBlock;
-                        {
-                            LOCK(pfrom->cs_filter);
-                            if (pfrom->pfilter) {
-                                sendMerkleBlock = true;
-                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
-                            }
-                        }
-                        if (sendMerkleBlock) {
-                            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
-                        }
-                        // else
-                            // no response
+                    fSendBlock = true;
+                    invBlock = inv;
+                    posBlock = mi->second->GetBlockPos();
+                    fNearTip = mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (inv.type == MSG_CMPCT_BLOCK) {
+                        fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+                        fCanDirectFetch = CanDirectFetch(consensusParams);
                     }
-                    else if (inv.type == MSG_CMPCT_BLOCK)
-                    {
-                        // If a peer is asking for old blocks, we're almost guaranteed
-                        // they won't have a useful mempool to match against a compact block,
-                        // and we don't feel like constructing the object for them, so
-                        // instead we respond with the full, non-compact block.
-                        bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-                        int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-                        if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                            CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
-                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                        } else
-                            connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block));
-                    }
-
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
                     {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+                        hashContinueTip = chainActive.Tip()->GetBlockHash();
                         pfrom->hashContinue.SetNull();
                     }
                 }
@@ -1006,10 +1027,17 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             {
                 // Send stream from relay memory
                 bool push = false;
-                auto mi = mapRelay.find(inv.hash);
+                CTransactionRef txRelay;
+                {
+                    CRelayShard& shard = GetRelayShard(inv.hash);
+                    LOCK(shard.cs);
+                    auto mi = shard.mapRelay.find(inv.hash);
+                    if (mi != shard.mapRelay.end())
+                        txRelay = mi->second;
+                }
                 int nSendFlags = (inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0);
-                if (mi != mapRelay.end()) {
-                    connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::TX, *mi->second));
+                if (txRelay) {
+                    connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::TX, *txRelay));
                     push = true;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
@@ -1033,6 +1061,91 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
         }
     }
 
+    if (fSendBlock) {
+        bool fFullBlock = invBlock.type == MSG_BLOCK || invBlock.type == MSG_WITNESS_BLOCK;
+        bool fWitness = invBlock.type == MSG_WITNESS_BLOCK;
+        CNetMsgPayloadRef payload;
+        if (fFullBlock && fNearTip) {
+            LOCK(cs_recentBlock);
+            if (hashRecentBlock == invBlock.hash)
+                payload = recentBlock[fWitness];
+        }
+
+        // Send block from disk. Pruning may have removed it since cs_main
+        // was released, in which case the request is dropped.
+        CBlock block;
+        if (payload) {
+            connman.PushMessage(pfrom, msgMaker.MakeWithPayload(NetMsgType::BLOCK, payload));
+        } else if (!ReadBlockFromDisk(block, posBlock, consensusParams) || block.GetHash() != invBlock.hash) {
+            LogPrint("net", "%s: cannot load block %s requested by peer=%d\n", __func__, invBlock.hash.ToString(), pfrom->GetId());
+            fSendBlock = false;
+        } else {
+            if (fFullBlock)
+            {
+                payload = msgMaker.MakePayload(fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS, block);
+                if (fNearTip) {
+                    LOCK(cs_recentBlock);
+                    if (hashRecentBlock != invBlock.hash) {
+                        hashRecentBlock = invBlock.hash;
+                        recentBlock[0].reset();
+                        recentBlock[1].reset();
+                    }
+                    recentBlock[fWitness] = payload;
+                }
+                connman.PushMessage(pfrom, msgMaker.MakeWithPayload(NetMsgType::BLOCK, payload));
+            }
+            else if (invBlock.type == MSG_FILTERED_BLOCK)
+            {
+                bool sendMerkleBlock = false;
+                CMerkleBlock merkleBlock;
+                {
+                    LOCK(pfrom->cs_filter);
+                    if (pfrom->pfilter) {
+                        sendMerkleBlock = true;
+                        merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                    }
+                }
+                if (sendMerkleBlock) {
+                    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::MERKLEBLOCK, merkleBlock));
+                    // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                    // This avoids hurting performance by pointlessly requiring a round-trip
+                    // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                    // they must either disconnect and retry or request the full block.
+                    // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                    // however we MUST always provide at least what the remote peer needs
+                    typedef std::pair<unsigned int, uint256> PairType;
+                    BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                        connman.PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]));
+                }
+                // else
+                    // no response
+            }
+            else if (invBlock.type == MSG_CMPCT_BLOCK)
+            {
+                // If a peer is asking for old blocks, we're almost guaranteed
+                // they won't have a useful mempool to match against a compact block,
+                // and we don't feel like constructing the object for them, so
+                // instead we respond with the full, non-compact block.
+                int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+                if (fCanDirectFetch && fNearTip) {
+                    CBlockHeaderAndShortTxIDs cmpctblock(block, fPeerWantsWitness);
+                    connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
+                } else
+                    connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, block));
+            }
+        }
+
+        if (fSendBlock && !hashContinueTip.IsNull())
+        {
+            // Bypass PushInventory, this must send even if redundant,
+            // and we want it right after the last block so they don't
+            // wait for other stuff first.
+            vector<CInv> vInv;
+            vInv.push_back(CInv(MSG_BLOCK, hashContinueTip));
+            connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::INV, vInv));
+        }
+    }
+
     pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
 
     if (!vNotFound.empty()) {
@@ -1049,7 +1162,8 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
 uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params& chainparams) {
     uint32_t nFetchFlags = 0;
-    if ((pfrom->GetLocalServices() & NODE_WITNESS) && State(pfrom->GetId())->fHaveWitness) {
+    // Same as CNodeState::fHaveWitness, but readable without cs_main
+    if ((pfrom->GetLocalServices() & NODE_WITNESS) && (pfrom->nServices & NODE_WITNESS)) {
         nFetchFlags |= MSG_WITNESS_FLAG;
     }
     return nFetchFlags;
@@ -1367,9 +1481,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->fWhitelisted && GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY))
             fBlocksOnly = false;
 
-        LOCK(cs_main);
-
-        uint32_t nFetchFlags = GetFetchFlags(pfrom, chainActive.Tip(), chainparams.GetConsensus());
+        // Transaction announcements only use relay state that has its own
+        // locks; cs_main is taken for block announcements alone.
+        uint32_t nFetchFlags = GetFetchFlags(pfrom, NULL, chainparams.GetConsensus());
 
         std::vector<CInv> vToFetch;
 
@@ -1379,14 +1493,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             boost::this_thread::interruption_point();
 
-            bool fAlreadyHave = AlreadyHave(inv);
-            LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
-
-            if (inv.type == MSG_TX) {
-                inv.type |= nFetchFlags;
-            }
-
             if (inv.type == MSG_BLOCK) {
+                LOCK(cs_main);
+                bool fAlreadyHave = AlreadyHave(inv);
+                LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
                     // We used to request the full block here, but since headers-announcements are now the
@@ -1400,6 +1510,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
             else
             {
+                bool fAlreadyHave = AlreadyHave(inv);
+                LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
+                if (inv.type == MSG_TX) {
+                    inv.type |= nFetchFlags;
+                }
                 pfrom->AddInventoryKnown(inv);
                 if (fBlocksOnly)
                     LogPrint("net", "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->id);
@@ -1411,6 +1526,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             GetMainSignals().Inventory(inv.hash);
 
             if (pfrom->nSendSize > (nMaxSendBufferSize * 2)) {
+                LOCK(cs_main);
                 Misbehaving(pfrom->GetId(), 50);
                 return error("send buffer size() = %u", pfrom->nSendSize);
             }
@@ -1601,13 +1717,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        // Verify the scripts before taking cs_main, so that transactions from
+        // different peers are checked in parallel on the message handler
+        // threads and AcceptToMemoryPool below mostly hits the signature cache.
+        if (!AlreadyHave(inv))
+            PreValidateTransaction(mempool, tx);
+
+        LOCK2(cs_main, cs_orphans);
 
         bool fMissingInputs = false;
         CValidationState state;
 
         pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
+        {
+            LOCK(cs_mapAlreadyAskedFor);
+            mapAlreadyAskedFor.erase(inv.hash);
+        }
 
         if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
             mempool.check(pcoinsTip);
@@ -1672,6 +1797,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             // Do not use rejection cache for witness transactions or
                             // witness-stripped transactions, as they can have been malleated.
                             // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                            LOCK(cs_recentRejects);
                             assert(recentRejects);
                             recentRejects->insert(orphanHash);
                         }
@@ -1686,10 +1812,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         else if (fMissingInputs)
         {
             bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
-            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
+            {
+                LOCK(cs_recentRejects);
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    if (recentRejects->contains(txin.prevout.hash)) {
+                        fRejectedParents = true;
+                        break;
+                    }
                 }
             }
             if (!fRejectedParents) {
@@ -1714,6 +1843,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 // Do not use rejection cache for witness transactions or
                 // witness-stripped transactions, as they can have been malleated.
                 // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                LOCK(cs_recentRejects);
                 assert(recentRejects);
                 recentRejects->insert(tx.GetHash());
             }
@@ -2205,9 +2335,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
         vector<CAddress> vAddr = connman.GetAddresses();
         FastRandomContext insecure_rand;
+        LOCK(pfrom->cs_addrSend);
+        pfrom->vAddrToSend.clear();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr, insecure_rand);
     }
@@ -2552,23 +2683,94 @@ bool ProcessMessages(CNode* pfrom, CConnman& connman)
     return fOk;
 }
 
-class CompareInvMempoolOrder
+namespace {
+/**
+ * Relay order of queued transaction announcements, shared by all peers.
+ *
+ * Rather than every peer sorting its own queue against the mempool on each
+ * trickle, the union of what peers have queued is sorted at most once per
+ * ORDER_INTERVAL. A peer then marks its queue in a bitmap over that order
+ * and reads it front to back. Queues holding transactions that are not in
+ * the current order yet fall back to a sort of their own until the next
+ * rebuild, so announcements stay topologically sorted.
+ */
+class CInvRelayOrder
 {
-    CTxMemPool *mp;
-public:
-    CompareInvMempoolOrder(CTxMemPool *_mempool)
+    //! Minimum time between rebuilds of the order, in microseconds
+    static const int64_t ORDER_INTERVAL = 1000000;
+    //! Transactions no peer had queued for this long are dropped from the order, in microseconds
+    static const int64_t ORDER_EXPIRY = 30 * 1000000;
+
+    CCriticalSection cs;
+    //! Queued transactions, best first (protected by cs)
+    std::vector<uint256> vOrder;
+    //! Position of every entry of vOrder (protected by cs)
+    std::unordered_map<uint256, uint32_t, SaltedTxidHasher> mapPos;
+    //! Last time some peer had each entry of vOrder queued (protected by cs)
+    std::vector<int64_t> vLastQueued;
+    int64_t nNextRebuild;
+
+    void Rebuild(const std::vector<uint256>& vAdd, int64_t nNow)
     {
-        mp = _mempool;
+        std::vector<uint256> vNew(vAdd);
+        for (size_t i = 0; i < vOrder.size(); i++) {
+            if (vLastQueued[i] + ORDER_EXPIRY > nNow)
+                vNew.push_back(vOrder[i]);
+        }
+        mempool.SortByDepthAndScore(vNew);
+
+        vOrder.swap(vNew);
+        mapPos.clear();
+        mapPos.reserve(vOrder.size());
+        for (size_t i = 0; i < vOrder.size(); i++)
+            mapPos.emplace(vOrder[i], i);
+        vLastQueued.assign(vOrder.size(), nNow);
+        nNextRebuild = nNow + ORDER_INTERVAL;
     }
 
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
+public:
+    CInvRelayOrder() : nNextRebuild(0) {}
+
+    //! Return the transactions in setQueued best first, as CompareDepthAndScore would order them.
+    void Order(const std::set<uint256>& setQueued, int64_t nNow, std::vector<uint256>& vResult)
     {
-        /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
+        vResult.clear();
+        {
+            LOCK(cs);
+            std::vector<uint256> vMissing;
+            for (const uint256& hash : setQueued) {
+                if (!mapPos.count(hash))
+                    vMissing.push_back(hash);
+            }
+            if (!vMissing.empty() && nNow >= nNextRebuild) {
+                Rebuild(vMissing, nNow);
+                vMissing.clear();
+            }
+            if (vMissing.empty()) {
+                std::vector<uint64_t> vBits((vOrder.size() + 63) / 64);
+                for (const uint256& hash : setQueued) {
+                    uint32_t nPos = mapPos.find(hash)->second;
+                    vBits[nPos >> 6] |= (uint64_t)1 << (nPos & 63);
+                    vLastQueued[nPos] = nNow;
+                }
+                vResult.reserve(setQueued.size());
+                for (size_t i = 0; i < vBits.size(); i++) {
+                    for (size_t nPos = i * 64; vBits[i]; vBits[i] >>= 1, nPos++) {
+                        if (vBits[i] & 1)
+                            vResult.push_back(vOrder[nPos]);
+                    }
+                }
+                return;
+            }
+        }
+        vResult.assign(setQueued.begin(), setQueued.end());
+        mempool.SortByDepthAndScore(vResult);
     }
 };
 
+CInvRelayOrder invRelayOrder;
+} // anon namespace
+
 bool SendMessages(CNode* pto, CConnman& connman)
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -2647,6 +2849,7 @@ bool SendMessages(CNode* pto, CConnman& connman)
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -2776,13 +2979,22 @@ bool SendMessages(CNode* pto, CConnman& connman)
                     // probably means we're doing an initial-ish-sync or they're slow
                     LogPrint("net", "%s sending header-and-ids %s to peer %d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->id);
-                    //TODO: Shouldn't need to reload block from disk, but requires refactor
-                    CBlock block;
-                    bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
-                    assert(ret);
-                    CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
-                    int nSendFlags = state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-                    connman.PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
+                    if (hashCmpctAnnounced != pBestIndex->GetBlockHash()) {
+                        hashCmpctAnnounced = pBestIndex->GetBlockHash();
+                        cmpctAnnounced[0].reset();
+                        cmpctAnnounced[1].reset();
+                    }
+                    CNetMsgPayloadRef& payload = cmpctAnnounced[state.fWantsCmpctWitness];
+                    if (!payload) {
+                        //TODO: Shouldn't need to reload block from disk, but requires refactor
+                        CBlock block;
+                        bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
+                        assert(ret);
+                        CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
+                        int nSendFlags = state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
+                        payload = msgMaker.MakePayload(nSendFlags, cmpctblock);
+                    }
+                    connman.PushMessage(pto, msgMaker.MakeWithPayload(NetMsgType::CMPCTBLOCK, payload));
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -2895,33 +3107,22 @@ bool SendMessages(CNode* pto, CConnman& connman)
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
                 // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                vector<uint256> vInvTx;
+                invRelayOrder.Order(pto->setInventoryTxToSend, nNow, vInvTx);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
+                for (size_t i = 0; i < vInvTx.size() && nRelayedTransactions < INVENTORY_BROADCAST_MAX; i++) {
+                    const uint256& hash = vInvTx[i];
                     // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
+                    pto->setInventoryTxToSend.erase(hash);
                     // Check if not in the filter already
                     if (pto->filterInventoryKnown.contains(hash)) {
                         continue;
@@ -2939,16 +3140,18 @@ bool SendMessages(CNode* pto, CConnman& connman)
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
                     {
+                        CRelayShard& shard = GetRelayShard(hash);
+                        LOCK(shard.cs);
                         // Expire old relay messages
-                        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
+                        while (!shard.vRelayExpiration.empty() && shard.vRelayExpiration.front().first < nNow)
                         {
-                            mapRelay.erase(vRelayExpiration.front().second);
-                            vRelayExpiration.pop_front();
+                            shard.mapRelay.erase(shard.vRelayExpiration.front().second);
+                            shard.vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = shard.mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
                         if (ret.second) {
-                            vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
+                            shard.vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
                     }
                     if (vInv.size() == MAX_INV_SZ) {
@@ -3073,6 +3276,7 @@ public:
     CNetProcessingCleanup() {}
     ~CNetProcessingCleanup() {
         // orphan transactions
+        LOCK(cs_orphans);
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
     }
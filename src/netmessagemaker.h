@@ -29,6 +29,23 @@ public:
         return Make(0, std::move(sCommand), std::forward<Args>(args)...);
     }
 
+    /** Serialize a payload once, for sending to several peers with MakeWithPayload */
+    template <typename... Args>
+    CNetMsgPayloadRef MakePayload(int nFlags, Args&&... args)
+    {
+        std::vector<unsigned char> data;
+        CVectorWriter{ SER_NETWORK, nFlags | nVersion, data, 0, std::forward<Args>(args)... };
+        return MakeNetMsgPayload(std::move(data));
+    }
+
+    CSerializedNetMsg MakeWithPayload(std::string sCommand, CNetMsgPayloadRef payload)
+    {
+        CSerializedNetMsg msg;
+        msg.command = std::move(sCommand);
+        msg.payload = std::move(payload);
+        return msg;
+    }
+
 private:
     const int nVersion;
 };
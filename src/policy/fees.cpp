@@ -13,22 +13,24 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay)
+                                unsigned int _maxConfirms, double _decay)
 {
     decay = _decay;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+    buckets = defaultBuckets;
+    maxConfirms = _maxConfirms;
+    Resize();
+}
+
+void TxConfirmStats::Resize()
+{
+    confAvg.resize(maxConfirms * buckets.size());
+    curBlockConf.resize(maxConfirms * buckets.size());
+    unconfTxs.resize(maxConfirms * buckets.size());
 
     oldUnconfTxs.resize(buckets.size());
     curBlockTxCt.resize(buckets.size());
@@ -37,17 +39,23 @@ void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
     avg.resize(buckets.size());
 }
 
+unsigned int TxConfirmStats::FindBucket(double val) const
+{
+    // The last bucket is INF_FEERATE, but clamp anyway rather than index past the end
+    unsigned int bucketindex = std::lower_bound(buckets.begin(), buckets.end(), val) - buckets.begin();
+    return std::min(bucketindex, (unsigned int)buckets.size() - 1);
+}
+
 // Zero out the data for the current block
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
-    }
+    std::vector<int>::iterator row = unconfTxs.begin() + (nBlockHeight % maxConfirms) * buckets.size();
+    for (unsigned int j = 0; j < buckets.size(); j++)
+        oldUnconfTxs[j] += row[j];
+    std::fill(row, row + buckets.size(), 0);
+    std::fill(curBlockConf.begin(), curBlockConf.end(), 0);
+    std::fill(curBlockTxCt.begin(), curBlockTxCt.end(), 0);
+    std::fill(curBlockVal.begin(), curBlockVal.end(), 0);
 }
 
 
@@ -56,9 +64,9 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
     // blocksToConfirm is 1-based
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
+    unsigned int bucketindex = FindBucket(val);
+    for (size_t i = blocksToConfirm; i <= maxConfirms; i++) {
+        curBlockConf[(i - 1) * buckets.size() + bucketindex]++;
     }
     curBlockTxCt[bucketindex]++;
     curBlockVal[bucketindex] += val;
@@ -66,9 +74,13 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
 
 void TxConfirmStats::UpdateMovingAverages()
 {
+    // Plain loops over contiguous arrays, which the compiler can vectorize
+    const size_t nEntries = confAvg.size();
+    double* pconf = confAvg.data();
+    const int* pcur = curBlockConf.data();
+    for (size_t i = 0; i < nEntries; i++)
+        pconf[i] = pconf[i] * decay + pcur[i];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
         avg[j] = avg[j] * decay + curBlockVal[j];
         txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
     }
@@ -104,15 +116,16 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    unsigned int bins = maxConfirms;
+    const size_t nBuckets = buckets.size();
 
     // Start counting from highest(default) or lowest feerate transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        nConf += confAvg[(confTarget - 1) * nBuckets + bucket];
         totalNum += txCtAvg[bucket];
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+            extraNum += unconfTxs[((nBlockHeight - confct)%bins) * nBuckets + bucket];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
@@ -179,7 +192,11 @@ void TxConfirmStats::Write(CAutoFile& fileout)
     fileout << buckets;
     fileout << avg;
     fileout << txCtAvg;
-    fileout << confAvg;
+    // The file keeps the nested per-confirmation layout
+    std::vector<std::vector<double> > vConfAvg(maxConfirms);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        vConfAvg[i].assign(confAvg.begin() + i * buckets.size(), confAvg.begin() + (i + 1) * buckets.size());
+    fileout << vConfAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein)
@@ -190,7 +207,7 @@ void TxConfirmStats::Read(CAutoFile& filein)
     std::vector<std::vector<double> > fileConfAvg;
     std::vector<double> fileTxCtAvg;
     double fileDecay;
-    size_t maxConfirms;
+    size_t fileMaxConfirms;
     size_t numBuckets;
 
     filein >> fileDecay;
@@ -207,10 +224,10 @@ void TxConfirmStats::Read(CAutoFile& filein)
     if (fileTxCtAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
+    fileMaxConfirms = fileConfAvg.size();
+    if (fileMaxConfirms <= 0 || fileMaxConfirms > 6 * 24 * 7) // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
+    for (unsigned int i = 0; i < fileMaxConfirms; i++) {
         if (fileConfAvg[i].size() != numBuckets)
             throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
     }
@@ -218,38 +235,27 @@ void TxConfirmStats::Read(CAutoFile& filein)
     // thrown any errors, we can copy it to our data structures
     decay = fileDecay;
     buckets = fileBuckets;
+    maxConfirms = fileMaxConfirms;
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
+    confAvg.clear();
+    confAvg.reserve(maxConfirms * numBuckets);
+    for (unsigned int i = 0; i < maxConfirms; i++)
+        confAvg.insert(confAvg.end(), fileConfAvg[i].begin(), fileConfAvg[i].end());
 
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
-
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    Resize();
 
     LogPrint("estimatefee", "Reading estimates: %u buckets counting confirms up to %u blocks\n",
-             numBuckets, maxConfirms);
+             numBuckets, fileMaxConfirms);
 }
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int bucketindex = FindBucket(val);
+    unsigned int blockIndex = nBlockHeight % maxConfirms;
+    unconfTxs[blockIndex * buckets.size() + bucketindex]++;
     return bucketindex;
 }
 
@@ -264,7 +270,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)maxConfirms) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
@@ -272,16 +278,117 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
                      bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % maxConfirms;
+        if (unconfTxs[blockIndex * buckets.size() + bucketindex] > 0)
+            unconfTxs[blockIndex * buckets.size() + bucketindex]--;
         else
             LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
     }
 }
 
+CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
+    : nBestSeenHeight(0), fQueueReady(false)
+{
+    minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
+    std::vector<double> vfeelist;
+    for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING) {
+        vfeelist.push_back(bucketBoundary);
+    }
+    vfeelist.push_back(INF_FEERATE);
+    feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
+}
+
+void CBlockPolicyEstimator::Enqueue(QueuedUpdate& update, bool fNotify)
+{
+    bool fApplyNow;
+    {
+        boost::unique_lock<boost::mutex> lock(csQueue);
+        vQueue.push_back(QueuedUpdate());
+        std::swap(vQueue.back(), update);
+        fNotify |= vQueue.size() >= FEE_UPDATE_QUEUE_NOTIFY;
+        if (fNotify) {
+            fQueueReady = true;
+            condQueue.notify_one();
+        }
+        // Without a thread draining the queue (or while it lags far behind)
+        // apply the updates here rather than let the queue grow without bound
+        fApplyNow = vQueue.size() >= FEE_UPDATE_QUEUE_MAX;
+    }
+    if (fApplyNow)
+        ApplyQueuedUpdates();
+}
+
+void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
+{
+    QueuedUpdate update;
+    update.type = QueuedUpdate::TX_ADDED;
+    update.hash = entry.GetTx().GetHash();
+    update.nHeight = entry.GetHeight();
+    // Feerates are stored and reported as BTC-per-kb:
+    update.feeRate = (double)CFeeRate(entry.GetFee(), entry.GetTxSize()).GetFeePerK();
+    update.fClearAtEntry = entry.WasClearAtEntry();
+    update.fCurrentEstimate = fCurrentEstimate;
+    Enqueue(update, false);
+}
+
 void CBlockPolicyEstimator::removeTx(uint256 hash)
+{
+    QueuedUpdate update;
+    update.type = QueuedUpdate::TX_REMOVED;
+    update.hash = hash;
+    Enqueue(update, false);
+}
+
+void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
+                                         std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
+{
+    QueuedUpdate update;
+    update.type = QueuedUpdate::BLOCK;
+    update.nHeight = nBlockHeight;
+    update.fCurrentEstimate = fCurrentEstimate;
+    update.vConfirmed.resize(entries.size());
+    for (unsigned int i = 0; i < entries.size(); i++) {
+        ConfirmedTx& tx = update.vConfirmed[i];
+        tx.entryHeight = entries[i].GetHeight();
+        tx.feeRate = (double)CFeeRate(entries[i].GetFee(), entries[i].GetTxSize()).GetFeePerK();
+        tx.fClearAtEntry = entries[i].WasClearAtEntry();
+    }
+    Enqueue(update, true);
+}
+
+void CBlockPolicyEstimator::ApplyQueuedUpdates()
+{
+    LOCK(cs);
+    std::vector<QueuedUpdate> vUpdates;
+    {
+        boost::unique_lock<boost::mutex> lock(csQueue);
+        vUpdates.swap(vQueue);
+        fQueueReady = false;
+    }
+    BOOST_FOREACH(const QueuedUpdate& update, vUpdates) {
+        switch (update.type) {
+        case QueuedUpdate::TX_ADDED: ApplyTransaction(update); break;
+        case QueuedUpdate::TX_REMOVED: ApplyRemoveTx(update.hash); break;
+        case QueuedUpdate::BLOCK: ApplyBlock(update); break;
+        }
+    }
+}
+
+void CBlockPolicyEstimator::ThreadApplyUpdates()
+{
+    RenameThread("bitcoin-feeest");
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(csQueue);
+            while (!fQueueReady)
+                condQueue.wait(lock);
+        }
+        ApplyQueuedUpdates();
+    }
+}
+
+void CBlockPolicyEstimator::ApplyRemoveTx(const uint256& hash)
 {
     std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
     if (pos == mapMemPoolTxs.end()) {
@@ -293,25 +400,13 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
     unsigned int bucketIndex = pos->second.bucketIndex;
 
     feeStats.removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+    mapMemPoolTxs.erase(pos);
 }
 
-CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0)
+void CBlockPolicyEstimator::ApplyTransaction(const QueuedUpdate& update)
 {
-    minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
-    std::vector<double> vfeelist;
-    for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING) {
-        vfeelist.push_back(bucketBoundary);
-    }
-    vfeelist.push_back(INF_FEERATE);
-    feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY);
-}
-
-void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
-{
-    unsigned int txHeight = entry.GetHeight();
-    uint256 hash = entry.GetTx().GetHash();
+    unsigned int txHeight = update.nHeight;
+    const uint256& hash = update.hash;
     if (mapMemPoolTxs.count(hash)) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
@@ -326,26 +421,23 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
-    if (!fCurrentEstimate)
+    if (!update.fCurrentEstimate)
         return;
 
-    if (!entry.WasClearAtEntry()) {
+    if (!update.fClearAtEntry) {
         // This transaction depends on other transactions in the mempool to
         // be included in a block before it will be able to be included, so
         // we shouldn't include it in our calculations
         return;
     }
 
-    // Feerates are stored and reported as BTC-per-kb:
-    CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
-
     mapMemPoolTxs[hash].blockHeight = txHeight;
-    mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+    mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, update.feeRate);
 }
 
-void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
+void CBlockPolicyEstimator::ApplyBlockTx(unsigned int nBlockHeight, const ConfirmedTx& tx)
 {
-    if (!entry.WasClearAtEntry()) {
+    if (!tx.fClearAtEntry) {
         // This transaction depended on other transactions in the mempool to
         // be included in a block before it was able to be included, so
         // we shouldn't include it in our calculations
@@ -355,7 +447,7 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
     // How many blocks did it take for miners to include this transaction?
     // blocksToConfirm is 1-based, so a transaction included in the earliest
     // possible block has confirmation count of 1
-    int blocksToConfirm = nBlockHeight - entry.GetHeight();
+    int blocksToConfirm = nBlockHeight - tx.entryHeight;
     if (blocksToConfirm <= 0) {
         // This can't happen because we don't process transactions from a block with a height
         // lower than our greatest seen height
@@ -363,15 +455,12 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
         return;
     }
 
-    // Feerates are stored and reported as BTC-per-kb:
-    CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
-
-    feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
+    feeStats.Record(blocksToConfirm, tx.feeRate);
 }
 
-void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
-                                         std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
+void CBlockPolicyEstimator::ApplyBlock(const QueuedUpdate& update)
 {
+    unsigned int nBlockHeight = update.nHeight;
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
         // they don't affect the estimate.
@@ -384,25 +473,27 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
 
     // Only want to be updating estimates when our blockchain is synced,
     // otherwise we'll miscalculate how many blocks its taking to get included.
-    if (!fCurrentEstimate)
+    if (!update.fCurrentEstimate)
         return;
 
     // Clear the current block state
     feeStats.ClearCurrent(nBlockHeight);
 
     // Repopulate the current block states
-    for (unsigned int i = 0; i < entries.size(); i++)
-        processBlockTx(nBlockHeight, entries[i]);
+    BOOST_FOREACH(const ConfirmedTx& tx, update.vConfirmed)
+        ApplyBlockTx(nBlockHeight, tx);
 
     // Update all exponential averages with the current block state
     feeStats.UpdateMovingAverages();
 
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
-             entries.size(), mapMemPoolTxs.size());
+             update.vConfirmed.size(), mapMemPoolTxs.size());
 }
 
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
+    ApplyQueuedUpdates();
+    LOCK(cs);
     // Return failure if trying to analyze a target we're not tracking
     // It's not possible to get reasonable estimates for confTarget of 1
     if (confTarget <= 1 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
@@ -418,6 +509,8 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 
 CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
+    ApplyQueuedUpdates();
+    LOCK(cs);
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
@@ -467,12 +560,16 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerF
 
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
 {
+    ApplyQueuedUpdates();
+    LOCK(cs);
     fileout << nBestSeenHeight;
     feeStats.Write(fileout);
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein, int nFileVersion)
 {
+    ApplyQueuedUpdates();
+    LOCK(cs);
     int nFileBestSeenHeight;
     filein >> nFileBestSeenHeight;
     feeStats.Read(filein);
@@ -8,6 +8,7 @@
 #include "amount.h"
 #include "uint256.h"
 #include "random.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -71,8 +72,12 @@ class TxConfirmStats
 {
 private:
     //Define the buckets we will group transactions into
-    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets;              // The upper-bound of the range for the bucket (inclusive), ascending
+    unsigned int maxConfirms;
+
+    // The per-confirmation tables below are stored flat, one row of
+    // buckets.size() entries per confirmation count, so that the per-block
+    // updates run over contiguous memory. Entry [Y][X] is at Y * buckets.size() + X.
 
     // For each bucket X:
     // Count the total # of txs in each bucket
@@ -83,9 +88,9 @@ private:
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
+    std::vector<double> confAvg; // confAvg[Y][X]
     // and calculate the totals for the current block to update the moving averages
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
+    std::vector<int> curBlockConf; // curBlockConf[Y][X]
 
     // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -101,10 +106,16 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    // This is a ring buffer indexed by entry height modulo maxConfirms
+    std::vector<int> unconfTxs;  //unconfTxs[Y][X]
     // transactions still unconfirmed after MAX_CONFIRMS for each bucket
     std::vector<int> oldUnconfTxs;
 
+    /** Index of the bucket for a feerate */
+    unsigned int FindBucket(double val) const;
+    /** Size all tables for the current buckets and maxConfirms */
+    void Resize();
+
 public:
     /**
      * Initialize the data structures.  This is called by BlockPolicyEstimator's
@@ -152,7 +163,7 @@ public:
                              double minSuccess, bool requireGreater, unsigned int nBlockHeight);
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() { return confAvg.size(); }
+    unsigned int GetMaxConfirms() { return maxConfirms; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout);
@@ -190,10 +201,21 @@ static const double INF_PRIORITY = 1e9 * MAX_MONEY;
 /** Spacing of FeeRate buckets */
 static const double FEE_SPACING = 1.1;
 
+/** Wake the update thread once this many mempool updates are queued */
+static const size_t FEE_UPDATE_QUEUE_NOTIFY = 1000;
+/** Apply queued updates synchronously once this many are pending */
+static const size_t FEE_UPDATE_QUEUE_MAX = 100000;
+
 /**
  *  We want to be able to estimate feerates that are needed on tx's to be included in
  * a certain number of blocks.  Every time a block is added to the best chain, this class records
  * stats on the transactions included in that block
+ *
+ * Mempool and block notifications are only queued by the public update
+ * methods, which the mempool calls under its lock. The queue is applied in
+ * order by ThreadApplyUpdates, or by whichever estimate, Read or Write call
+ * comes first, so estimates are the same as if every update had been
+ * applied right away.
  */
 class CBlockPolicyEstimator
 {
@@ -205,9 +227,6 @@ public:
     void processBlock(unsigned int nBlockHeight,
                       std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate);
 
-    /** Process a transaction confirmed in a block*/
-    void processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry);
-
     /** Process a transaction accepted to the mempool*/
     void processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate);
 
@@ -243,7 +262,48 @@ public:
     /** Read estimation data from a file */
     void Read(CAutoFile& filein, int nFileVersion);
 
+    /** Apply queued updates as they arrive, until interrupted */
+    void ThreadApplyUpdates();
+
 private:
+    /** What a confirmed transaction contributes to the statistics */
+    struct ConfirmedTx
+    {
+        unsigned int entryHeight;
+        double feeRate;
+        bool fClearAtEntry;
+    };
+
+    /** A queued notification from the mempool */
+    struct QueuedUpdate
+    {
+        enum Type { TX_ADDED, TX_REMOVED, BLOCK } type;
+        uint256 hash;
+        //! Entry height for TX_ADDED, block height for BLOCK
+        unsigned int nHeight;
+        double feeRate;
+        bool fClearAtEntry;
+        bool fCurrentEstimate;
+        std::vector<ConfirmedTx> vConfirmed;
+    };
+
+    CWaitableCriticalSection csQueue;
+    CConditionVariable condQueue;
+    //! Updates not yet applied to the statistics (protected by csQueue)
+    std::vector<QueuedUpdate> vQueue;
+    //! Set when ThreadApplyUpdates should wake up (protected by csQueue)
+    bool fQueueReady;
+    void Enqueue(QueuedUpdate& update, bool fNotify);
+
+    //! Protects the statistics below; taken before csQueue
+    CCriticalSection cs;
+    /** Apply all queued updates */
+    void ApplyQueuedUpdates();
+    void ApplyTransaction(const QueuedUpdate& update);
+    void ApplyRemoveTx(const uint256& hash);
+    void ApplyBlock(const QueuedUpdate& update);
+    void ApplyBlockTx(unsigned int nBlockHeight, const ConfirmedTx& tx);
+
     CFeeRate minTrackedFee;    //!< Passed to constructor to avoid dependency on main
     unsigned int nBestSeenHeight;
     struct TxStatsInfo
@@ -0,0 +1,199 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <vector>
+
+/**
+ * Memory pool for many small objects of a few different sizes, such as the
+ * nodes of node-based containers.
+ *
+ * Requests are rounded up to a multiple of ALIGNMENT and served from a free
+ * list per size, which is refilled from blocks of BLOCK_SIZE bytes. Freed
+ * chunks go back to their free list and are reused by the next allocation of
+ * the same size; blocks are only released when the pool is destroyed.
+ * Requests larger than MAX_CHUNK_SIZE go to operator new.
+ *
+ * The pool keeps an exact count of the bytes handed out (see DynamicUsage()),
+ * so that containers using it can be accounted without estimating allocator
+ * overhead. ChunkUsage() only counts the pooled chunks, which for node-based
+ * containers is the size of their nodes without bucket arrays and the like. It is not thread safe; callers must serialize access, usually
+ * with the lock that protects the containers using it.
+ */
+class PoolResource
+{
+public:
+    static const size_t ALIGNMENT = sizeof(void*);
+    static const size_t MAX_CHUNK_SIZE = 512;
+    static const size_t BLOCK_SIZE = 256 * 1024;
+
+    PoolResource() : vFree(MAX_CHUNK_SIZE / ALIGNMENT + 1, NULL), pcur(NULL), pend(NULL), nUsage(0), nLargeUsage(0) {}
+
+    ~PoolResource()
+    {
+        for (std::vector<void*>::iterator it = vBlocks.begin(); it != vBlocks.end(); ++it)
+            ::operator delete(*it);
+    }
+
+    void* Allocate(size_t nBytes, size_t nAlign)
+    {
+        if (nBytes > MAX_CHUNK_SIZE || nAlign > ALIGNMENT)
+            return AllocateUnpooled(nBytes);
+        const size_t nClass = ChunkClass(nBytes);
+        const size_t nChunk = nClass * ALIGNMENT;
+        if (vFree[nClass] != NULL) {
+            void* p = vFree[nClass];
+            vFree[nClass] = *static_cast<void**>(p);
+            nUsage += nChunk;
+            return p;
+        }
+        if ((size_t)(pend - pcur) < nChunk) {
+            vBlocks.reserve(vBlocks.size() + 1);
+            char* pblock = static_cast<char*>(::operator new(BLOCK_SIZE));
+            vBlocks.push_back(pblock);
+            // Put the remainder of the current block on the free lists before starting the new one.
+            while ((size_t)(pend - pcur) >= ALIGNMENT) {
+                const size_t nRest = std::min((size_t)(pend - pcur) / ALIGNMENT, MAX_CHUNK_SIZE / ALIGNMENT);
+                PushFree(pcur, nRest);
+                pcur += nRest * ALIGNMENT;
+            }
+            pcur = pblock;
+            pend = pcur + BLOCK_SIZE;
+        }
+        void* p = pcur;
+        pcur += nChunk;
+        nUsage += nChunk;
+        return p;
+    }
+
+    void Deallocate(void* p, size_t nBytes, size_t nAlign)
+    {
+        if (nBytes > MAX_CHUNK_SIZE || nAlign > ALIGNMENT) {
+            DeallocateUnpooled(p, nBytes);
+            return;
+        }
+        const size_t nClass = ChunkClass(nBytes);
+        nUsage -= nClass * ALIGNMENT;
+        PushFree(static_cast<char*>(p), nClass);
+    }
+
+    /** Allocate from operator new, only accounting the memory. */
+    void* AllocateUnpooled(size_t nBytes)
+    {
+        void* p = ::operator new(nBytes);
+        nLargeUsage += memusage::MallocUsage(nBytes);
+        return p;
+    }
+
+    void DeallocateUnpooled(void* p, size_t nBytes)
+    {
+        nLargeUsage -= memusage::MallocUsage(nBytes);
+        ::operator delete(p);
+    }
+
+    /** Bytes currently handed out, including rounding and large allocations. */
+    size_t DynamicUsage() const { return nUsage + nLargeUsage; }
+    /** Bytes currently handed out in pooled chunks. */
+    size_t ChunkUsage() const { return nUsage; }
+    /** Bytes held in blocks, whether handed out or not. */
+    size_t BlockUsage() const { return vBlocks.size() * memusage::MallocUsage(BLOCK_SIZE); }
+
+private:
+    //! Free list heads per chunk size in units of ALIGNMENT; the next pointer is stored in the chunk
+    std::vector<void*> vFree;
+    std::vector<void*> vBlocks;
+    char* pcur;
+    char* pend;
+    size_t nUsage;
+    size_t nLargeUsage;
+
+    static size_t ChunkClass(size_t nBytes)
+    {
+        return nBytes == 0 ? 1 : (nBytes + ALIGNMENT - 1) / ALIGNMENT;
+    }
+
+    void PushFree(char* p, size_t nClass)
+    {
+        *reinterpret_cast<void**>(p) = vFree[nClass];
+        vFree[nClass] = p;
+    }
+
+    PoolResource(const PoolResource&);
+    PoolResource& operator=(const PoolResource&);
+};
+
+/**
+ * Allocator that takes its memory from a PoolResource, which must outlive
+ * every container using it. Only single objects are pooled; arrays are passed
+ * through to operator new, but still accounted by the resource.
+ */
+template <typename T>
+class pool_allocator
+{
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef pool_allocator<U> other;
+    };
+
+    explicit pool_allocator(PoolResource* resourceIn) throw() : resource(resourceIn) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : resource(a.resource) {}
+
+    pointer allocate(size_type n, const void* hint = 0)
+    {
+        if (n > max_size())
+            throw std::bad_alloc();
+        if (n != 1)
+            return static_cast<pointer>(resource->AllocateUnpooled(n * sizeof(T)));
+        return static_cast<pointer>(resource->Allocate(sizeof(T), alignof(T)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        if (p == NULL)
+            return;
+        if (n != 1)
+            resource->DeallocateUnpooled(p, n * sizeof(T));
+        else
+            resource->Deallocate(p, sizeof(T), alignof(T));
+    }
+
+    size_type max_size() const throw() { return std::numeric_limits<size_type>::max() / sizeof(T); }
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    void construct(pointer p, const T& val) { new ((void*)p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+
+    template <typename U>
+    bool operator==(const pool_allocator<U>& a) const { return resource == a.resource; }
+    template <typename U>
+    bool operator!=(const pool_allocator<U>& a) const { return resource != a.resource; }
+
+private:
+    PoolResource* resource;
+
+    template <typename U>
+    friend class pool_allocator;
+};
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
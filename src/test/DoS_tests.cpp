@@ -31,6 +31,7 @@ struct COrphanTx {
     NodeId fromPeer;
     int64_t nTimeExpire;
 };
+extern CCriticalSection cs_orphans;
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 
 CService ip(uint32_t i)
@@ -126,6 +127,7 @@ CTransaction RandomOrphan()
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
 {
+    LOCK(cs_orphans);
     CKey key;
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
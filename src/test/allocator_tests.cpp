@@ -4,6 +4,7 @@
 
 #include "util.h"
 
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
@@ -231,4 +232,50 @@ BOOST_AUTO_TEST_CASE(lockedpool_tests_live)
     BOOST_CHECK(pool.stats().used == initial.used);
 }
 
+BOOST_AUTO_TEST_CASE(pool_resource_tests)
+{
+    PoolResource resource;
+    BOOST_CHECK(resource.DynamicUsage() == 0);
+
+    void *a0 = resource.Allocate(20, 8);
+    void *a1 = resource.Allocate(20, 8);
+    BOOST_CHECK(a0 != a1);
+    BOOST_CHECK(resource.DynamicUsage() == 48); // Rounded to 8
+    BOOST_CHECK(resource.BlockUsage() > 0);
+    resource.Deallocate(a0, 20, 8);
+    BOOST_CHECK(resource.DynamicUsage() == 24);
+    // Freed chunks are reused by allocations of the same size
+    void *a2 = resource.Allocate(24, 8);
+    BOOST_CHECK(a2 == a0);
+    resource.Deallocate(a1, 20, 8);
+    resource.Deallocate(a2, 24, 8);
+    BOOST_CHECK(resource.DynamicUsage() == 0);
+
+    // Large allocations bypass the blocks but are still accounted
+    void *a3 = resource.Allocate(PoolResource::MAX_CHUNK_SIZE + 1, 8);
+    BOOST_CHECK(resource.DynamicUsage() == memusage::MallocUsage(PoolResource::MAX_CHUNK_SIZE + 1));
+    resource.Deallocate(a3, PoolResource::MAX_CHUNK_SIZE + 1, 8);
+    BOOST_CHECK(resource.DynamicUsage() == 0);
+
+    // Containers return all their memory when cleared
+    {
+        typedef pool_allocator<std::pair<const int, int> > Alloc;
+        std::less<int> comp;
+        std::map<int, int, std::less<int>, Alloc> m(comp, Alloc(&resource));
+        for (int i = 0; i < 100000; i++)
+            m[i] = i;
+        BOOST_CHECK(resource.DynamicUsage() > 0);
+        BOOST_CHECK(resource.BlockUsage() >= resource.DynamicUsage());
+        for (int i = 0; i < 100000; i += 2)
+            m.erase(i);
+        for (int i = 1; i < 100000; i += 2)
+            BOOST_CHECK(m[i] == i);
+        const size_t nBlockUsage = resource.BlockUsage();
+        for (int i = 0; i < 100000; i += 2)
+            m[i] = i;
+        BOOST_CHECK(resource.BlockUsage() == nBlockUsage);
+    }
+    BOOST_CHECK(resource.DynamicUsage() == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,135 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "random.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindex_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockindex_snapshot)
+{
+    // A main chain of 100 blocks with a 10 block fork off height 50.
+    std::vector<uint256> vHash(110);
+    std::vector<CBlockIndex> vIndex(110);
+    std::vector<const CBlockIndex*> vSorted;
+    for (int i = 0; i < 110; i++) {
+        CBlockIndex& index = vIndex[i];
+        vHash[i] = GetRandHash();
+        index.phashBlock = &vHash[i];
+        index.pprev = i == 0 ? NULL : i == 100 ? &vIndex[50] : &vIndex[i - 1];
+        index.nHeight = index.pprev ? index.pprev->nHeight + 1 : 0;
+        index.nFile = i / 30;
+        index.nDataPos = insecure_rand();
+        index.nUndoPos = insecure_rand();
+        index.nVersion = 4;
+        index.hashMerkleRoot = GetRandHash();
+        index.nTime = 1400000000 + i;
+        index.nBits = 0x207fffff;
+        index.nNonce = insecure_rand();
+        index.nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+        index.nTx = 1 + insecure_rand() % 1000;
+    }
+    for (int nHeight = 0; nHeight < 100; nHeight++) {
+        for (int i = 0; i < 110; i++) {
+            if (vIndex[i].nHeight == nHeight)
+                vSorted.push_back(&vIndex[i]);
+        }
+    }
+    BOOST_CHECK_EQUAL(vSorted.size(), 110U);
+
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CBlockIndexSnapshot snapshot;
+    BOOST_CHECK(!snapshot.Open(path));
+    BOOST_CHECK(CBlockIndexSnapshot::Write(path, 12345, vSorted));
+    BOOST_CHECK(snapshot.Open(path));
+    BOOST_CHECK_EQUAL(snapshot.GetId(), 12345U);
+    BOOST_CHECK_EQUAL(snapshot.size(), vSorted.size());
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        CBlockIndex index;
+        uint256 hash, hashPrev;
+        snapshot.GetRecord(i, hash, hashPrev, index);
+        const CBlockIndex& orig = *vSorted[i];
+        BOOST_CHECK(hash == orig.GetBlockHash());
+        BOOST_CHECK(hashPrev == (orig.pprev ? orig.pprev->GetBlockHash() : uint256()));
+        BOOST_CHECK(index.hashMerkleRoot == orig.hashMerkleRoot);
+        BOOST_CHECK_EQUAL(index.nVersion, orig.nVersion);
+        BOOST_CHECK_EQUAL(index.nTime, orig.nTime);
+        BOOST_CHECK_EQUAL(index.nBits, orig.nBits);
+        BOOST_CHECK_EQUAL(index.nNonce, orig.nNonce);
+        BOOST_CHECK_EQUAL(index.nHeight, orig.nHeight);
+        BOOST_CHECK_EQUAL(index.nFile, orig.nFile);
+        BOOST_CHECK_EQUAL(index.nDataPos, orig.nDataPos);
+        BOOST_CHECK_EQUAL(index.nUndoPos, orig.nUndoPos);
+        BOOST_CHECK_EQUAL(index.nStatus, orig.nStatus);
+        BOOST_CHECK_EQUAL(index.nTx, orig.nTx);
+    }
+
+    // Any corruption is detected by the checksum.
+    FILE* file = fopen(path.string().c_str(), "r+b");
+    BOOST_REQUIRE(file);
+    fseek(file, CBlockIndexSnapshot::HEADER_SIZE + 7 * CBlockIndexSnapshot::RECORD_SIZE + 100, SEEK_SET);
+    fputc(0xff, file);
+    fclose(file);
+    BOOST_CHECK(!snapshot.Open(path));
+    BOOST_CHECK_EQUAL(snapshot.size(), 0U);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_map)
+{
+    CBlockIndexMap map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(GetRandHash()) == map.end());
+    BOOST_CHECK(map[GetRandHash()] == NULL);
+
+    // Enough entries to span several chunks and resize the slot table a few times.
+    std::vector<uint256> vHash(5000);
+    std::vector<CBlockIndex*> vIndex;
+    for (size_t i = 0; i < vHash.size(); i++) {
+        vHash[i] = GetRandHash();
+        std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(vHash[i]);
+        BOOST_CHECK(ret.second);
+        BOOST_CHECK(ret.first->first == vHash[i]);
+        BOOST_CHECK(ret.first->second->phashBlock == &ret.first->first);
+        ret.first->second->nHeight = i;
+        vIndex.push_back(ret.first->second);
+    }
+    BOOST_CHECK_EQUAL(map.size(), vHash.size());
+
+    // Inserting an existing hash returns the existing entry.
+    std::pair<CBlockIndexMap::iterator, bool> ret = map.insert(vHash[42]);
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK(ret.first->second == vIndex[42]);
+    BOOST_CHECK_EQUAL(map.size(), vHash.size());
+
+    // Entries keep their address, and iteration is in insertion order.
+    size_t i = 0;
+    for (CBlockIndexMap::const_iterator it = map.begin(); it != map.end(); ++it, ++i) {
+        BOOST_CHECK(it->first == vHash[i]);
+        BOOST_CHECK(it->second == vIndex[i]);
+        BOOST_CHECK_EQUAL(it->second->nHeight, (int)i);
+        BOOST_CHECK(map.find(vHash[i]) == it);
+        BOOST_CHECK(map[vHash[i]] == vIndex[i]);
+        BOOST_CHECK_EQUAL(map.count(vHash[i]), 1U);
+    }
+    BOOST_CHECK_EQUAL(i, vHash.size());
+    BOOST_CHECK_EQUAL(map.count(GetRandHash()), 0U);
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(vHash[0]) == map.end());
+    BOOST_CHECK(map.insert(vHash[0]).second);
+    BOOST_CHECK_EQUAL(map.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -324,4 +324,43 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
 
 
 
+BOOST_AUTO_TEST_CASE(dbwrapper_options)
+{
+    mapArgs["-dbbloombits"] = "0";
+    mapArgs["-chainstate-dbbloombits"] = "16";
+    mapArgs["-dbblocksize"] = "16384";
+    CDBOptions chainstateOptions = CDBOptions::FromArgs("chainstate");
+    CDBOptions blockindexOptions = CDBOptions::FromArgs("blockindex");
+    mapArgs.erase("-dbbloombits");
+    mapArgs.erase("-chainstate-dbbloombits");
+    mapArgs.erase("-dbblocksize");
+
+    // Per-database overrides take precedence over the generic option.
+    BOOST_CHECK_EQUAL(chainstateOptions.nBloomBits, 16);
+    BOOST_CHECK_EQUAL(blockindexOptions.nBloomBits, 0);
+    BOOST_CHECK_EQUAL(chainstateOptions.nBlockSize, 16384U);
+    BOOST_CHECK_EQUAL(blockindexOptions.nBlockSize, 16384U);
+    BOOST_CHECK_EQUAL(blockindexOptions.nMaxOpenFiles, DEFAULT_DB_MAX_OPEN_FILES);
+
+    // Two databases can share a block cache, which outlives either of them.
+    std::shared_ptr<leveldb::Cache> cache = NewDBBlockCache(1 << 20);
+    chainstateOptions.blockCache = blockindexOptions.blockCache = cache;
+    chainstateOptions.fCompression = true;
+    {
+        CDBWrapper dbw1(temp_directory_path() / unique_path(), (1 << 20), true, false, false, chainstateOptions);
+        CDBWrapper dbw2(temp_directory_path() / unique_path(), (1 << 20), true, false, true, blockindexOptions);
+        for (int i = 0; i < 2; i++) {
+            CDBWrapper& dbw = i ? dbw2 : dbw1;
+            uint256 in = GetRandHash();
+            uint256 res;
+            BOOST_CHECK(dbw.Write('k', in));
+            BOOST_CHECK(dbw.Read('k', res));
+            BOOST_CHECK_EQUAL(res.ToString(), in.ToString());
+        }
+    }
+    chainstateOptions.blockCache.reset();
+    blockindexOptions.blockCache.reset();
+    BOOST_CHECK(cache.unique());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
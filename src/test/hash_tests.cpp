@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -107,6 +108,13 @@ BOOST_AUTO_TEST_CASE(siphash)
 
     BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
 
+    // SipHashUint256Extra must match the generic hasher fed the uint256 followed by the 4-byte extra
+    CSipHasher hasherExtra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    for (uint8_t x=0; x<36; ++x) {
+        hasherExtra.Write(&x, 1);
+    }
+    BOOST_CHECK_EQUAL(SipHashUint256Extra(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256S("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100"), 0x23222120UL), hasherExtra.Finalize());
+
     // Check test vectors from spec, one byte at a time
     CSipHasher hasher2(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
     for (uint8_t x=0; x<ARRAYLEN(siphash_4_2_testvec); ++x)
@@ -130,6 +138,19 @@ BOOST_AUTO_TEST_CASE(siphash)
     tx.nVersion = 1;
     ss << tx;
     BOOST_CHECK_EQUAL(SipHashUint256(1, 2, ss.GetHash()), 0x79751e980c2a0a35ULL);
+
+    // SipHashUint256Lanes must match SipHashUint256 in every lane
+    uint256 vals[SIPHASH_LANES];
+    const uint256* pvals[SIPHASH_LANES];
+    uint64_t out[SIPHASH_LANES];
+    for (size_t l = 0; l < SIPHASH_LANES; l++) {
+        vals[l] = GetRandHash();
+        pvals[l] = &vals[l];
+    }
+    SipHashUint256Lanes(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, pvals, out);
+    for (size_t l = 0; l < SIPHASH_LANES; l++) {
+        BOOST_CHECK_EQUAL(out[l], SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, vals[l]));
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
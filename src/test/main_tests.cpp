@@ -3,8 +3,11 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "consensus/validation.h"
 #include "validation.h"
 #include "net.h"
+#include "pow.h"
+#include "random.h"
 
 #include "test/test_bitcoin.h"
 
@@ -73,4 +76,47 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+BOOST_FIXTURE_TEST_CASE(process_new_block_headers, TestChain100Setup)
+{
+    // A chain of headers off the tip, long enough to be checked on the header check threads
+    const CChainParams& chainparams = Params();
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+    std::vector<CBlockHeader> headers;
+    uint256 hashPrev = pindexTip->GetBlockHash();
+    for (unsigned int i = 0; i < 2 * MIN_PARALLEL_HEADER_CHECKS; i++) {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = hashPrev;
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = pindexTip->GetBlockTime() + 1 + i;
+        header.nBits = pindexTip->nBits;
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, chainparams.GetConsensus())) ++header.nNonce;
+        hashPrev = header.GetHash();
+        headers.push_back(header);
+    }
+
+    // Invalid proof of work in the middle: the headers before it are accepted
+    std::vector<CBlockHeader> badHeaders(headers);
+    CBlockHeader& bad = badHeaders[MIN_PARALLEL_HEADER_CHECKS];
+    while (CheckProofOfWork(bad.GetHash(), bad.nBits, chainparams.GetConsensus())) ++bad.nNonce;
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(!ProcessNewBlockHeaders(badHeaders, state, chainparams, &pindex));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "high-hash");
+    BOOST_CHECK(pindex && pindex->GetBlockHash() == headers[MIN_PARALLEL_HEADER_CHECKS - 1].GetHash());
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(mapBlockIndex.find(bad.GetHash()) == mapBlockIndex.end());
+    }
+
+    CValidationState state2;
+    BOOST_CHECK(ProcessNewBlockHeaders(headers, state2, chainparams, &pindex));
+    BOOST_CHECK(pindex->GetBlockHash() == headers.back().GetHash());
+    BOOST_CHECK_EQUAL(pindex->nHeight, pindexTip->nHeight + (int)headers.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -105,6 +105,73 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     BOOST_CHECK_EQUAL(testPool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolDiamondTest)
+{
+    // Ancestor and descendant walks must visit an entry reachable along
+    // several paths exactly once: A -> (B, C) -> D
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction txMid[2];
+    for (int i = 0; i < 2; i++) {
+        txMid[i].vin.resize(1);
+        txMid[i].vin[0].scriptSig = CScript() << OP_11;
+        txMid[i].vin[0].prevout = COutPoint(txA.GetHash(), i);
+        txMid[i].vout.resize(1);
+        txMid[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txMid[i].vout[0].nValue = 9 * COIN;
+    }
+    CMutableTransaction txD;
+    txD.vin.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txD.vin[i].scriptSig = CScript() << OP_11;
+        txD.vin[i].prevout = COutPoint(txMid[i].GetHash(), 0);
+    }
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txD.vout[0].nValue = 17 * COIN;
+
+    pool.addUnchecked(txA.GetHash(), entry.FromTx(txA));
+    pool.addUnchecked(txMid[0].GetHash(), entry.FromTx(txMid[0]));
+    pool.addUnchecked(txMid[1].GetHash(), entry.FromTx(txMid[1]));
+
+    CTxMemPool::setEntries setAncestors;
+    std::string dummy;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(txD), setAncestors, 100, 1000000, 1000, 1000000, dummy));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    CTxMemPool::setEntries setLimited;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(txD), setLimited, 3, 1000000, 1000, 1000000, dummy));
+
+    pool.addUnchecked(txD.GetHash(), entry.FromTx(txD), setAncestors);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txD.GetHash())->GetCountWithAncestors(), 4);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txA.GetHash())->GetCountWithDescendants(), 4);
+
+    CTxMemPool::setEntries setDescendants;
+    pool.CalculateDescendants(pool.mapTx.find(txA.GetHash()), setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 4);
+
+    std::vector<CTxMemPool::txiter> vRoots;
+    vRoots.push_back(pool.mapTx.find(txMid[0].GetHash()));
+    vRoots.push_back(pool.mapTx.find(txMid[1].GetHash()));
+    setDescendants.clear();
+    pool.CalculateDescendants(vRoots, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 3);
+    BOOST_CHECK(!setDescendants.count(pool.mapTx.find(txA.GetHash())));
+
+    pool.removeRecursive(txMid[0]);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK(!pool.exists(txD.GetHash()));
+    BOOST_CHECK_EQUAL(pool.mapTx.find(txA.GetHash())->GetCountWithDescendants(), 2);
+}
+
 template<typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -429,6 +496,18 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
         sortedOrder.erase(sortedOrder.end()-2);
     sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
     CheckSort<ancestor_score>(pool, sortedOrder);
+
+    /* a batch sort matches CompareDepthAndScore, with unknown hashes last */
+    std::vector<uint256> vHashes;
+    pool.queryHashes(vHashes);
+    std::reverse(vHashes.begin(), vHashes.end());
+    vHashes.insert(vHashes.begin() + 2, tx6.GetHash());
+    pool.SortByDepthAndScore(vHashes);
+    BOOST_CHECK_EQUAL(vHashes.size(), pool.size() + 1);
+    BOOST_CHECK(vHashes.back() == tx6.GetHash());
+    for (size_t i = 1; i + 1 < vHashes.size(); i++) {
+        BOOST_CHECK(pool.CompareDepthAndScore(vHashes[i - 1], vHashes[i]));
+    }
 }
 
 
@@ -472,7 +551,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     tx3.vout[0].nValue = 10 * COIN;
     pool.addUnchecked(tx3.GetHash(), entry.Fee(20000LL).FromTx(tx3, &pool));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1); // tx3 should pay for tx2 (CPFP)
     BOOST_CHECK(!pool.exists(tx1.GetHash()));
     BOOST_CHECK(pool.exists(tx2.GetHash()));
     BOOST_CHECK(pool.exists(tx3.GetHash()));
@@ -548,7 +627,7 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
         pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should maximize mempool size by only removing 5/7
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
@@ -586,4 +665,57 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolBatchTrimTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    entry.dPriority = 10.0;
+
+    // Independent transactions, plus parent/child pairs where the child pays for its parent
+    std::vector<uint256> vHashes;
+    std::vector<CAmount> vFees;
+    for (unsigned int i = 0; i < 200; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(), i);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        CAmount nFee = 1000 + 97 * ((i * 37) % 200);
+        pool.addUnchecked(tx.GetHash(), entry.Fee(i % 10 ? nFee : 0).FromTx(tx, &pool));
+        vHashes.push_back(tx.GetHash());
+        vFees.push_back(nFee);
+        if (i % 10 == 0) {
+            CMutableTransaction child = tx;
+            child.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+            pool.addUnchecked(child.GetHash(), entry.Fee(2 * nFee).FromTx(child, &pool));
+        }
+    }
+
+    size_t nLimit = pool.DynamicMemoryUsage() / 2;
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(nLimit, &vNoSpendsRemaining);
+    BOOST_CHECK(pool.DynamicMemoryUsage() <= nLimit);
+
+    // What is left are the packages with the highest descendant feerates
+    CAmount nMaxRemoved = 0, nMinKept = MAX_MONEY;
+    unsigned int nRemoved = 0, nChildrenRemoved = 0;
+    for (unsigned int i = 0; i < vHashes.size(); i++) {
+        if (pool.exists(vHashes[i])) {
+            nMinKept = std::min(nMinKept, vFees[i]);
+        } else {
+            nMaxRemoved = std::max(nMaxRemoved, vFees[i]);
+            nRemoved++;
+            if (i % 10 == 0)
+                nChildrenRemoved++;
+        }
+    }
+    BOOST_CHECK(nRemoved > 0 && nChildrenRemoved > 0);
+    BOOST_CHECK(nMaxRemoved < nMinKept);
+    // Every removed transaction spent an outpoint that is now unspent in the mempool
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), nRemoved + nChildrenRemoved);
+    BOOST_CHECK(pool.GetMinFee(1).GetFeePerK() > 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
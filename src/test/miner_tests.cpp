@@ -2,14 +2,18 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "arith_uint256.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
 #include "validation.h"
+#include "key.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "random.h"
+#include "script/interpreter.h"
 #include "script/standard.h"
 #include "txmempool.h"
 #include "uint256.h"
@@ -490,4 +494,86 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_FIXTURE_TEST_CASE(CreateNewBlock_incremental, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // A parent spending the mature coinbase and a child spending the parent
+    std::vector<CMutableTransaction> chain(2);
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain[i].vin.resize(1);
+        chain[i].vin[0].prevout = COutPoint(i == 0 ? coinbaseTxns[0].GetHash() : chain[i - 1].GetHash(), 0);
+        chain[i].vout.resize(1);
+        chain[i].vout[0].nValue = (40 - i) * COIN;
+        chain[i].vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, chain[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        chain[i].vin[0].scriptSig << vchSig;
+    }
+
+    CValidationState state;
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, chain[0], false, NULL, true, 0));
+    }
+    std::unique_ptr<CBlockTemplate> pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPubKey);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // New transactions are appended to the previous selection
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, chain[1], false, NULL, true, 0));
+    }
+    pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPubKey, pblocktemplate.get());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == chain[0].GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == chain[1].GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -11 * COIN);
+
+    // Transactions that left the mempool are dropped along with their spends
+    mempool.removeRecursive(chain[0]);
+    pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptPubKey, pblocktemplate.get());
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(ScanNonces_midstate)
+{
+    CBlockHeader header;
+    header.nVersion = 4;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1480000000;
+    header.nBits = 0x207fffff;
+    header.nNonce = 0;
+
+    const CHeaderHasher hasher(header);
+    for (uint32_t nNonce = 0; nNonce < 16; nNonce++) {
+        header.nNonce = nNonce;
+        BOOST_CHECK(hasher.GetHash(nNonce) == header.GetHash());
+    }
+
+    // The lowest solution is found regardless of the number of threads
+    header.nBits = 0x1f00ffff;
+    header.nNonce = 0;
+    uint64_t nTried1, nTried4;
+    BOOST_CHECK(ScanNonces(header, 1 << 24, 1, nTried1));
+    uint32_t nNonce1 = header.nNonce;
+    BOOST_CHECK(UintToArith256(header.GetHash()) <= arith_uint256().SetCompact(header.nBits));
+    header.nNonce = 0;
+    BOOST_CHECK(ScanNonces(header, 1 << 24, 4, nTried4));
+    BOOST_CHECK_EQUAL(header.nNonce, nNonce1);
+    BOOST_CHECK_EQUAL(nTried1, nTried4);
+    BOOST_CHECK_EQUAL(nTried1, nNonce1);
+
+    // An exhausted range reports every nonce as tried
+    header.nNonce = 0;
+    BOOST_CHECK(!ScanNonces(header, nNonce1, 4, nTried4));
+    BOOST_CHECK_EQUAL(nTried4, nNonce1);
+    BOOST_CHECK_EQUAL(header.nNonce, 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -10,6 +10,7 @@
 #include "streams.h"
 #include "net.h"
 #include "netbase.h"
+#include "netmessagemaker.h"
 #include "chainparams.h"
 
 using namespace std;
@@ -174,4 +175,126 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+static std::vector<unsigned char> RawMessage(const char* pszCommand, const std::vector<unsigned char>& vPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ss(SER_NETWORK, INIT_PROTO_VERSION);
+    ss << hdr;
+    std::vector<unsigned char> vData(ss.begin(), ss.end());
+    vData.insert(vData.end(), vPayload.begin(), vPayload.end());
+    return vData;
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, 0, 0, "", false);
+    LOCK(node.cs_vRecvMsg);
+
+    std::vector<unsigned char> vPayload1(300000, 0xab);
+    std::vector<unsigned char> vPayload2(10, 0xcd);
+    std::vector<unsigned char> vData = RawMessage(NetMsgType::BLOCK, vPayload1);
+    std::vector<unsigned char> vData2 = RawMessage(NetMsgType::PING, vPayload2);
+    vData.insert(vData.end(), vData2.begin(), vData2.end());
+
+    // Feed the bytes in pieces that split headers and payloads
+    bool fComplete = false;
+    for (size_t nPos = 0; nPos < vData.size(); nPos += 7) {
+        bool fPieceComplete;
+        BOOST_CHECK(node.ReceiveMsgBytes((const char*)vData.data() + nPos, std::min<size_t>(7, vData.size() - nPos), fPieceComplete));
+        fComplete |= fPieceComplete;
+    }
+    BOOST_CHECK(fComplete);
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2);
+    const CNetMessage& msg1 = node.vRecvMsg[0];
+    const CNetMessage& msg2 = node.vRecvMsg[1];
+    BOOST_CHECK(msg1.complete() && msg2.complete());
+    BOOST_CHECK_EQUAL(msg1.hdr.GetCommand(), NetMsgType::BLOCK);
+    BOOST_CHECK_EQUAL(msg2.hdr.GetCommand(), NetMsgType::PING);
+    BOOST_CHECK(msg1.GetMessageHash() == Hash(vPayload1.begin(), vPayload1.end()));
+    BOOST_CHECK(msg2.GetMessageHash() == Hash(vPayload2.begin(), vPayload2.end()));
+    BOOST_CHECK(std::vector<unsigned char>(msg1.vRecv.begin(), msg1.vRecv.end()) == vPayload1);
+    BOOST_CHECK(std::vector<unsigned char>(msg2.vRecv.begin(), msg2.vRecv.end()) == vPayload2);
+
+    // The buffer of a processed message is reused for the next one
+    size_t nCapacity = node.vRecvMsg[1].vRecv.capacity();
+    node.vRecvMsg.clear();
+    vData = RawMessage(NetMsgType::PONG, vPayload2);
+    BOOST_CHECK(node.ReceiveMsgBytes((const char*)vData.data(), vData.size(), fComplete));
+    BOOST_CHECK(fComplete);
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1);
+    BOOST_CHECK(node.vRecvMsg[0].vRecv.capacity() >= nCapacity);
+}
+
+#ifndef WIN32
+static std::vector<unsigned char> RecvAll(SOCKET hSocket, size_t nSize)
+{
+    std::vector<unsigned char> vData(nSize);
+    size_t nRead = 0;
+    while (nRead < nSize) {
+        ssize_t n = recv(hSocket, vData.data() + nRead, nSize - nRead, 0);
+        if (n <= 0)
+            break;
+        nRead += n;
+    }
+    vData.resize(nRead);
+    return vData;
+}
+
+BOOST_AUTO_TEST_CASE(socket_send_data)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode* pnode = new CNode(0, NODE_NETWORK, 0, sv[0], addr, 0, 0, "", false);
+    CConnman connman(0x1337, 0x1337);
+    CNetMsgMaker msgMaker(INIT_PROTO_VERSION);
+
+    // A shared payload goes out with a normal header
+    CNetMsgPayloadRef payload = msgMaker.MakePayload(0, std::vector<unsigned char>(1000, 0x55));
+    connman.PushMessage(pnode, msgMaker.MakeWithPayload(NetMsgType::BLOCK, payload));
+    BOOST_CHECK(pnode->vSendMsg.empty());
+    std::vector<unsigned char> vHeader = RecvAll(sv[1], CMessageHeader::HEADER_SIZE);
+    CDataStream ssHeader(vHeader, SER_NETWORK, INIT_PROTO_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ssHeader >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::BLOCK);
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, payload->data.size());
+    BOOST_CHECK(memcmp(hdr.pchChecksum, payload->hash.begin(), CMessageHeader::CHECKSUM_SIZE) == 0);
+    BOOST_CHECK(RecvAll(sv[1], payload->data.size()) == payload->data);
+
+    // Several queued messages, one of them partially sent, are sent at once
+    std::vector<unsigned char> vExpected;
+    for (int i = 0; i < 3; i++) {
+        CQueuedNetMsg msg;
+        memset(msg.header, i, sizeof(msg.header));
+        msg.payload = i == 1 ? MakeNetMsgPayload(std::vector<unsigned char>()) : payload;
+        vExpected.insert(vExpected.end(), msg.header, msg.header + sizeof(msg.header));
+        vExpected.insert(vExpected.end(), msg.payload->data.begin(), msg.payload->data.end());
+        pnode->nSendSize += msg.size();
+        pnode->vSendMsg.push_back(msg);
+    }
+    pnode->nSendOffset = 10;
+    {
+        LOCK(pnode->cs_vSend);
+        BOOST_CHECK_EQUAL(SocketSendData(pnode), vExpected.size() - 10);
+    }
+    BOOST_CHECK(pnode->vSendMsg.empty());
+    BOOST_CHECK_EQUAL(pnode->nSendSize, 0);
+    BOOST_CHECK_EQUAL(pnode->nSendOffset, 0);
+    BOOST_CHECK(RecvAll(sv[1], vExpected.size() - 10) == std::vector<unsigned char>(vExpected.begin() + 10, vExpected.end()));
+    BOOST_CHECK_EQUAL(payload.use_count(), 1);
+
+    delete pnode;
+    close(sv[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
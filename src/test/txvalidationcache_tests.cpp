@@ -84,4 +84,128 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_prevalidate, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+
+    // A bad signature fails
+    CMutableTransaction badSpend(spend);
+    std::vector<unsigned char> vchBadSig(vchSig);
+    vchBadSig[10] ^= 1;
+    badSpend.vin[0].scriptSig << vchBadSig;
+    BOOST_CHECK(!PreValidateTransaction(mempool, badSpend));
+
+    // Missing inputs are left to AcceptToMemoryPool
+    CMutableTransaction orphan(spend);
+    orphan.vin[0].prevout.hash = GetRandHash();
+    orphan.vin[0].scriptSig << vchSig;
+    BOOST_CHECK(!PreValidateTransaction(mempool, orphan));
+
+    spend.vin[0].scriptSig << vchSig;
+    BOOST_CHECK(PreValidateTransaction(mempool, spend));
+    BOOST_CHECK(ToMemPool(spend));
+    // Already in the mempool
+    BOOST_CHECK(!PreValidateTransaction(mempool, spend));
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // A chain of three transactions spending the first coinbase, and one with a bad signature
+    std::vector<CMutableTransaction> chain(4);
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain[i].nVersion = 1;
+        chain[i].vin.resize(1);
+        chain[i].vin[0].prevout.hash = i == 0 || i == 3 ? coinbaseTxns[0].GetHash() : chain[i - 1].GetHash();
+        chain[i].vin[0].prevout.n = 0;
+        chain[i].vout.resize(1);
+        chain[i].vout[0].nValue = (40 - i) * COIN;
+        chain[i].vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, chain[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        if (i == 3)
+            vchSig[10] ^= 1;
+        chain[i].vin[0].scriptSig << vchSig;
+    }
+
+    // Children come before their parents in the batch
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(chain[3]));
+    vtx.push_back(MakeTransactionRef(chain[2]));
+    vtx.push_back(MakeTransactionRef(chain[1]));
+    vtx.push_back(MakeTransactionRef(chain[0]));
+    std::vector<bool> vAccepted;
+    std::vector<CValidationState> vState;
+    {
+        LOCK(cs_main);
+        AcceptToMemoryPoolBatch(mempool, vtx, std::vector<int64_t>(), false, true, vAccepted, vState);
+    }
+    BOOST_CHECK_EQUAL(vAccepted.size(), 4);
+    BOOST_CHECK(!vAccepted[0]);
+    BOOST_CHECK(vAccepted[1] && vAccepted[2] && vAccepted[3]);
+    BOOST_CHECK(vState[1].IsValid());
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_dump, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    std::vector<CMutableTransaction> chain(3);
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain[i].nVersion = 1;
+        chain[i].vin.resize(1);
+        chain[i].vin[0].prevout.hash = i == 0 ? coinbaseTxns[0].GetHash() : chain[i - 1].GetHash();
+        chain[i].vin[0].prevout.n = 0;
+        chain[i].vout.resize(1);
+        chain[i].vout[0].nValue = (40 - i) * COIN;
+        chain[i].vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, chain[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        chain[i].vin[0].scriptSig << vchSig;
+        BOOST_CHECK(ToMemPool(chain[i]));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+
+    DumpMempool();
+    mempool.clear();
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+
+    // A damaged chunk is rejected as a whole
+    DumpMempool();
+    mempool.clear();
+    std::string strPath = (GetDataDir() / "mempool.dat").string();
+    FILE* file = fopen(strPath.c_str(), "r+b");
+    BOOST_CHECK(file != NULL);
+    BOOST_CHECK_EQUAL(fseek(file, 64, SEEK_SET), 0);
+    int ch = fgetc(file);
+    BOOST_CHECK_EQUAL(fseek(file, 64, SEEK_SET), 0);
+    fputc(ch ^ 0x55, file);
+    fclose(file);
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,70 +6,263 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "reverselock.h"
 #include "uint256.h"
+#include "ui_interface.h"
 
 #include <stdint.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 
+static const char DB_HEAD_BLOCKS = 'H';
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SNAPSHOT_ID = 'S';
+
+
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
 
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, bool fAsyncFlush, const CDBOptions& dbOptions) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, dbOptions), fPending(false), fWriteFailed(false), fStopWriter(false)
 {
+    if (fAsyncFlush)
+        threadWriter = boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "coinsdb", boost::function<void()>(boost::bind(&CCoinsViewDB::ThreadWriteCoins, this))));
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+CCoinsViewDB::~CCoinsViewDB()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        fStopWriter = true;
+    }
+    condPending.notify_all();
+    if (threadWriter.joinable())
+        threadWriter.join();
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pcoinsPending) {
+            CCoinsMap::const_iterator it = pcoinsPending->find(outpoint);
+            if (it != pcoinsPending->end()) {
+                if (it->second.coin.IsSpent())
+                    return false;
+                coin = it->second.coin;
+                return true;
+            }
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-uint256 CCoinsViewDB::GetBestBlock() const {
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pcoinsPending) {
+            CCoinsMap::const_iterator it = pcoinsPending->find(outpoint);
+            if (it != pcoinsPending->end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return db.Exists(CoinEntry(&outpoint));
+}
+
+uint256 CCoinsViewDB::ReadBestBlock() const {
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (!hashPendingBlock.IsNull())
+            return hashPendingBlock;
+    }
+    return ReadBestBlock();
+}
+
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks)) {
+        return std::vector<uint256>();
+    }
+    return vhashHeadBlocks;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t batch_size = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+
+    if (!hashBlock.IsNull()) {
+        uint256 old_tip = ReadBestBlock();
+        if (old_tip.IsNull()) {
+            // A previous write was interrupted and its blocks were replayed
+            // in memory only; the on-disk state still starts at its old tip.
+            std::vector<uint256> old_heads = GetHeadBlocks();
+            if (old_heads.size() == 2)
+                old_tip = old_heads[1];
+        }
+        // In the first batch, mark the database as being in the middle of a
+        // transition from old_tip to hashBlock.
+        std::vector<uint256> vhashHeadBlocks;
+        vhashHeadBlocks.push_back(hashBlock);
+        vhashHeadBlocks.push_back(old_tip);
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Write(DB_HEAD_BLOCKS, vhashHeadBlocks);
+    }
+
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (batch.SizeEstimate() > batch_size) {
+            LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
     }
-    if (!hashBlock.IsNull())
+
+    // In the last batch, mark the database as consistent with hashBlock again.
+    if (!hashBlock.IsNull()) {
+        batch.Erase(DB_HEAD_BLOCKS);
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    if (!threadWriter.joinable()) {
+        bool ret = WriteCoins(mapCoins, hashBlock);
+        mapCoins.clear();
+        return ret;
+    }
+
+    boost::unique_lock<boost::mutex> lock(csPending);
+    // Keep at most one write in flight.
+    while (fPending)
+        condPending.wait(lock);
+    if (fWriteFailed)
+        return false;
+    // Take over the entries as they are; the writer skips non-dirty ones.
+    pcoinsPending.reset(new CCoinsMap(std::move(mapCoins)));
+    mapCoins.clear();
+    hashPendingBlock = hashBlock;
+    fPending = true;
+    condPending.notify_all();
+    return true;
+}
+
+bool CCoinsViewDB::Sync() {
+    boost::unique_lock<boost::mutex> lock(csPending);
+    while (fPending)
+        condPending.wait(lock);
+    return !fWriteFailed;
+}
+
+void CCoinsViewDB::ThreadWriteCoins()
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    while (true) {
+        while (!fPending && !fStopWriter)
+            condPending.wait(lock);
+        if (!fPending)
+            return;
+
+        // The pending map is not modified while fPending is set, so it can be
+        // read without holding csPending.
+        const CCoinsMap* pcoins = pcoinsPending.get();
+        uint256 hashBlock = hashPendingBlock;
+        bool fOk = false;
+        int64_t nStart = GetTimeMicros();
+        {
+            reverse_lock<boost::unique_lock<boost::mutex> > unlock(lock);
+            try {
+                fOk = WriteCoins(*pcoins, hashBlock);
+            } catch (const std::exception& e) {
+                LogPrintf("%s: %s\n", __func__, e.what());
+            }
+        }
+        LogPrint("coindb", "Background write of %u cache entries took %.2fms\n", (unsigned int)pcoins->size(), (GetTimeMicros() - nStart) * 0.001);
+
+        std::unique_ptr<CCoinsMap> pcoinsDone;
+        if (fOk) {
+            pcoinsDone.swap(pcoinsPending);
+            hashPendingBlock.SetNull();
+        } else {
+            // Keep answering reads from the pending entries; the node is
+            // expected to shut down after Sync() or BatchWrite() fails.
+            fWriteFailed = true;
+        }
+        fPending = false;
+        condPending.notify_all();
+        {
+            // Free the written entries without blocking readers.
+            reverse_lock<boost::unique_lock<boost::mutex> > unlock(lock);
+            pcoinsDone.reset();
+        }
+    }
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBOptions& dbOptions) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, dbOptions) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -94,29 +287,37 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
+    // The cursor iterates the database itself, so let pending changes land first.
+    const_cast<CCoinsViewDB*>(this)->Sync();
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
+    i->pcursor->Seek(DB_COIN);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (i->pcursor->Valid()) {
+        CoinEntry entry(&i->keyTmp.second);
+        i->pcursor->GetKey(entry);
+        i->keyTmp.first = entry.key;
+    } else {
+        i->keyTmp.first = 0; // Make sure Valid() and GetKey() return false
+    }
     return i;
 }
 
-bool CCoinsViewDBCursor::GetKey(uint256 &key) const
+bool CCoinsViewDBCursor::GetKey(COutPoint &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
+    if (keyTmp.first == DB_COIN) {
         key = keyTmp.second;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
+bool CCoinsViewDBCursor::GetValue(Coin &coin) const
 {
-    return pcursor->GetValue(coins);
+    return pcursor->GetValue(coin);
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
@@ -126,14 +327,18 @@ unsigned int CCoinsViewDBCursor::GetValueSize() const
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return keyTmp.first == DB_COIN;
 }
 
 void CCoinsViewDBCursor::Next()
 {
     pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
+    CoinEntry entry(&keyTmp.second);
+    if (!pcursor->Valid() || !pcursor->GetKey(entry)) {
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    } else {
+        keyTmp.first = entry.key;
+    }
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -145,9 +350,20 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
+    // Any block index snapshot on disk no longer matches.
+    if (!blockinfo.empty())
+        batch.Erase(DB_SNAPSHOT_ID);
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadSnapshotId(uint64_t& nId) {
+    return Read(DB_SNAPSHOT_ID, nId);
+}
+
+bool CBlockTreeDB::WriteSnapshotId(uint64_t nId) {
+    return Write(DB_SNAPSHOT_ID, nId, true);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
@@ -213,3 +429,282 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
 
     return true;
 }
+
+static const unsigned char SNAPSHOT_MAGIC[4] = {'b', 'i', 'd', 'x'};
+
+CBlockIndexSnapshot::CBlockIndexSnapshot() : pdata(NULL), nLength(0), fMapped(false), nId(0), nRecords(0)
+{
+}
+
+CBlockIndexSnapshot::~CBlockIndexSnapshot()
+{
+    Close();
+}
+
+void CBlockIndexSnapshot::Close()
+{
+#ifndef WIN32
+    if (fMapped)
+        munmap((void*)pdata, nLength);
+#endif
+    fMapped = false;
+    pdata = NULL;
+    nLength = 0;
+    vData.clear();
+    nId = 0;
+    nRecords = 0;
+}
+
+bool CBlockIndexSnapshot::Open(const boost::filesystem::path& path)
+{
+    Close();
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            pdata = (const unsigned char*)p;
+            nLength = st.st_size;
+            fMapped = true;
+        }
+    }
+    close(fd);
+    if (!fMapped)
+        return false;
+#else
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned char buf[65536];
+    size_t nRead;
+    while ((nRead = fread(buf, 1, sizeof(buf), file)) > 0)
+        vData.insert(vData.end(), buf, buf + nRead);
+    fclose(file);
+    pdata = vData.data();
+    nLength = vData.size();
+#endif
+
+    if (nLength < HEADER_SIZE + CSHA256::OUTPUT_SIZE || memcmp(pdata, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        Close();
+        return error("%s: %s is not a block index snapshot", __func__, path.string());
+    }
+    if (ReadLE32(pdata + 4) != CURRENT_VERSION) {
+        LogPrintf("%s: ignoring block index snapshot of version %u\n", __func__, ReadLE32(pdata + 4));
+        Close();
+        return false;
+    }
+    uint64_t nCount = ReadLE64(pdata + 16);
+    if (nCount > (nLength - HEADER_SIZE - CSHA256::OUTPUT_SIZE) / RECORD_SIZE ||
+        HEADER_SIZE + nCount * RECORD_SIZE + CSHA256::OUTPUT_SIZE != nLength) {
+        Close();
+        return error("%s: block index snapshot has wrong size", __func__);
+    }
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(pdata, nLength - CSHA256::OUTPUT_SIZE).Finalize(hash);
+    if (memcmp(hash, pdata + nLength - CSHA256::OUTPUT_SIZE, CSHA256::OUTPUT_SIZE) != 0) {
+        Close();
+        return error("%s: block index snapshot checksum mismatch", __func__);
+    }
+    nId = ReadLE64(pdata + 8);
+    nRecords = nCount;
+    return true;
+}
+
+void CBlockIndexSnapshot::GetRecord(size_t i, uint256& hash, uint256& hashPrev, CBlockIndex& index) const
+{
+    assert(i < nRecords);
+    const unsigned char* p = pdata + HEADER_SIZE + i * RECORD_SIZE;
+    memcpy(hash.begin(), p, 32);
+    memcpy(hashPrev.begin(), p + 32, 32);
+    memcpy(index.hashMerkleRoot.begin(), p + 64, 32);
+    index.nHeight = ReadLE32(p + 96);
+    index.nFile = ReadLE32(p + 100);
+    index.nDataPos = ReadLE32(p + 104);
+    index.nUndoPos = ReadLE32(p + 108);
+    index.nVersion = ReadLE32(p + 112);
+    index.nTime = ReadLE32(p + 116);
+    index.nBits = ReadLE32(p + 120);
+    index.nNonce = ReadLE32(p + 124);
+    index.nStatus = ReadLE32(p + 128);
+    index.nTx = ReadLE32(p + 132);
+}
+
+bool CBlockIndexSnapshot::Write(const boost::filesystem::path& path, uint64_t nId, const std::vector<const CBlockIndex*>& vIndex)
+{
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("%s: failed to open %s", __func__, pathTmp.string());
+
+    CSHA256 hasher;
+    std::vector<unsigned char> vBuf(HEADER_SIZE);
+    memcpy(&vBuf[0], SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    WriteLE32(&vBuf[4], CURRENT_VERSION);
+    WriteLE64(&vBuf[8], nId);
+    WriteLE64(&vBuf[16], vIndex.size());
+    bool fOk = true;
+    for (size_t i = 0; i <= vIndex.size(); i++) {
+        if (vBuf.size() >= (1 << 20) || i == vIndex.size()) {
+            hasher.Write(vBuf.data(), vBuf.size());
+            fOk &= fwrite(vBuf.data(), 1, vBuf.size(), file) == vBuf.size();
+            vBuf.clear();
+        }
+        if (i == vIndex.size())
+            break;
+        const CBlockIndex* pindex = vIndex[i];
+        size_t nPos = vBuf.size();
+        vBuf.resize(nPos + RECORD_SIZE);
+        unsigned char* p = &vBuf[nPos];
+        memcpy(p, pindex->GetBlockHash().begin(), 32);
+        memcpy(p + 32, pindex->pprev ? pindex->pprev->GetBlockHash().begin() : uint256().begin(), 32);
+        memcpy(p + 64, pindex->hashMerkleRoot.begin(), 32);
+        WriteLE32(p + 96, pindex->nHeight);
+        WriteLE32(p + 100, pindex->nFile);
+        WriteLE32(p + 104, pindex->nDataPos);
+        WriteLE32(p + 108, pindex->nUndoPos);
+        WriteLE32(p + 112, pindex->nVersion);
+        WriteLE32(p + 116, pindex->nTime);
+        WriteLE32(p + 120, pindex->nBits);
+        WriteLE32(p + 124, pindex->nNonce);
+        WriteLE32(p + 128, pindex->nStatus);
+        WriteLE32(p + 132, pindex->nTx);
+    }
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(hash);
+    fOk &= fwrite(hash, 1, sizeof(hash), file) == sizeof(hash);
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s", __func__, path.string());
+    }
+    return true;
+}
+
+namespace {
+
+//! Legacy class to deserialize pre-pertxout database entries without reindex.
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model (0.8..0.14.x) to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    std::unique_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> key;
+    std::pair<unsigned char, uint256> prev_key = std::make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::make_pair((unsigned char)DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
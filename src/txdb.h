@@ -9,6 +9,7 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -16,6 +17,7 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -35,6 +37,10 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = true;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -61,19 +67,53 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * Changes are written in batches of at most -dbbatchsize bytes. While a write
+ * is in progress the database carries a head-blocks marker naming the old and
+ * the new best block, so an interrupted write can be completed on the next
+ * startup by ReplayBlocks().
+ *
+ * With fAsyncFlush, BatchWrite only takes ownership of the passed entries and
+ * a background thread writes them out; until it is done, reads are answered
+ * from those entries. At most one such write is in flight at a time.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    mutable CWaitableCriticalSection csPending;
+    CConditionVariable condPending;
+    //! Entries handed to BatchWrite that have not reached the database yet (protected by csPending)
+    std::unique_ptr<CCoinsMap> pcoinsPending;
+    //! Best block of pcoinsPending; null when no write is in flight (protected by csPending)
+    uint256 hashPendingBlock;
+    bool fPending;
+    bool fWriteFailed;
+    bool fStopWriter;
+    boost::thread threadWriter;
+
+    //! Write a set of changes (non-dirty entries are skipped) in bounded batches
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
+    void ThreadWriteCoins();
+    uint256 ReadBestBlock() const;
+
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool fAsyncFlush = false, const CDBOptions& dbOptions = CDBOptions());
+    ~CCoinsViewDB();
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
+    std::vector<uint256> GetHeadBlocks() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool Sync();
     CCoinsViewCursor *Cursor() const;
+
+    //! Convert a pre-per-outpoint chainstate in place. Returns false on error or interruption.
+    bool Upgrade();
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -82,8 +122,8 @@ class CCoinsViewDBCursor: public CCoinsViewCursor
 public:
     ~CCoinsViewDBCursor() {}
 
-    bool GetKey(uint256 &key) const;
-    bool GetValue(CCoins &coins) const;
+    bool GetKey(COutPoint &key) const;
+    bool GetValue(Coin &coin) const;
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -93,7 +133,7 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
         CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
     std::unique_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    std::pair<char, COutPoint> keyTmp;
 
     friend class CCoinsViewDB;
 };
@@ -102,7 +142,7 @@ private:
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBOptions& dbOptions = CDBOptions());
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
@@ -117,6 +157,53 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! The id of the block index snapshot that matches the database, if any
+    bool ReadSnapshotId(uint64_t& nId);
+    bool WriteSnapshotId(uint64_t nId);
+};
+
+/**
+ * Flat copy of the block index (blocks/index.snapshot) that can be loaded
+ * without scanning the block tree database.
+ *
+ * The file holds a versioned header, fixed-size records in height order and
+ * a SHA256 checksum. It is memory-mapped for reading where supported. The
+ * header carries a random id that is also stored in the block tree database;
+ * any later write of block index entries erases that id, so a stale snapshot
+ * is never used.
+ */
+class CBlockIndexSnapshot
+{
+public:
+    static const uint32_t CURRENT_VERSION = 1;
+    static const size_t HEADER_SIZE = 24;
+    static const size_t RECORD_SIZE = 136;
+
+    CBlockIndexSnapshot();
+    ~CBlockIndexSnapshot();
+
+    //! Map and verify a snapshot file. Returns false if it is missing, corrupt or of another version.
+    bool Open(const boost::filesystem::path& path);
+    uint64_t GetId() const { return nId; }
+    size_t size() const { return nRecords; }
+    //! Read record i into index (except for phashBlock, pprev and pskip) and return its hashes.
+    void GetRecord(size_t i, uint256& hash, uint256& hashPrev, CBlockIndex& index) const;
+
+    //! Write a snapshot of the given entries, which must be sorted by height.
+    static bool Write(const boost::filesystem::path& path, uint64_t nId, const std::vector<const CBlockIndex*>& vIndex);
+
+private:
+    const unsigned char* pdata;
+    size_t nLength;
+    bool fMapped;
+    std::vector<unsigned char> vData;
+    uint64_t nId;
+    size_t nRecords;
+
+    void Close();
+
+    CBlockIndexSnapshot(const CBlockIndexSnapshot&);
+    void operator=(const CBlockIndexSnapshot&);
 };
 
 #endif // BITCOIN_TXDB_H
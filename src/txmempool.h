@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <assert.h>
 #include <memory>
 #include <set>
 #include <map>
@@ -19,6 +20,7 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 #include "random.h"
+#include "support/allocators/pool.h"
 
 #undef foreach
 #include "boost/multi_index_container.hpp"
@@ -40,7 +42,7 @@ inline bool AllowFree(double dPriority)
     return dPriority > AllowFreeThreshold();
 }
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 struct LockPoints
@@ -157,6 +159,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last mempool traversal that visited this entry (see CTxMemPool::visited)
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -432,6 +435,11 @@ private:
 
     void trackPackageRemoved(const CFeeRate& rate);
 
+    //! Memory for the nodes of mapTx, mapLinks and mapNextTx; declared first so it outlives them (protected by cs)
+    PoolResource poolTx;
+    PoolResource poolLinks;
+    PoolResource poolNextTx;
+
 public:
 
     static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
@@ -465,7 +473,8 @@ public:
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByAncestorFee
             >
-        >
+        >,
+        pool_allocator<CTxMemPoolEntry>
     > indexed_transaction_set;
 
     mutable CCriticalSection cs;
@@ -484,23 +493,49 @@ public:
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    typedef std::map<txiter, std::vector<txiter>, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
         setEntries parents;
         setEntries children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash, pool_allocator<std::pair<const txiter, TxLinks> > > txlinksMap;
     txlinksMap mapLinks;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    //! Current traversal epoch (protected by cs)
+    mutable uint64_t nEpoch;
+    mutable bool fEpochActive;
+
+    /**
+     * Starts a new traversal epoch for its lifetime. Graph walks mark entries
+     * with visited() instead of collecting them in a std::set. Epochs do not
+     * nest.
+     */
+    class EpochGuard {
+        const CTxMemPool& pool;
+    public:
+        EpochGuard(const CTxMemPool& poolIn);
+        ~EpochGuard();
+    };
+
+    /** Mark an entry as visited in the current epoch. Returns whether it already was. */
+    bool visited(txiter it) const
+    {
+        assert(fEpochActive);
+        if (it->nEpoch == nEpoch)
+            return true;
+        it->nEpoch = nEpoch;
+        return false;
+    }
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    indirectmap<COutPoint, const CTransaction*> mapNextTx;
+    indirectmap<COutPoint, const CTransaction*, pool_allocator<std::pair<const COutPoint* const, const CTransaction*> > > mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
     /** Create a new CTxMemPool.
@@ -536,7 +571,10 @@ public:
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    /** Sort vHashes the way CompareDepthAndScore does, taking the lock once.
+     *  Hashes that are not in the pool are kept at the end, in their original order. */
+    void SortByDepthAndScore(std::vector<uint256>& vHashes) const;
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
     /**
@@ -587,6 +625,8 @@ public:
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
+    /** As above, for all descendants of several entries in one walk. */
+    void CalculateDescendants(const std::vector<txiter> &vEntries, setEntries &setDescendants);
 
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
@@ -597,10 +637,12 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
-      *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
+      *  Packages are evicted lowest descendant score first. Consecutive
+      *  packages whose removal leaves no ancestors behind are removed together.
+      *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
-    void TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining=NULL);
+    void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=NULL);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
@@ -623,6 +665,13 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    bool exists(const COutPoint& outpoint) const
+    {
+        LOCK(cs);
+        auto it = mapTx.find(outpoint.hash);
+        return (it != mapTx.end() && outpoint.n < it->GetTx().vout.size());
+    }
+
     CTransactionRef get(const uint256& hash) const;
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
@@ -648,6 +697,8 @@ public:
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
+    /** Apply fee estimator updates in the background, until interrupted */
+    void ThreadFeeEstimator();
 
     size_t DynamicMemoryUsage() const;
 
@@ -701,8 +752,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
 };
 
 // We want to sort transactions by coin age priority
@@ -37,7 +37,9 @@
 #include "warnings.h"
 
 #include <atomic>
+#include <queue>
 #include <sstream>
+#include <unordered_map>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/algorithm/string/join.hpp>
@@ -362,15 +364,15 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
-            CCoins coins;
-            if (!viewMemPool.GetCoins(txin.prevout.hash, coins)) {
+            Coin coin;
+            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
-            if (coins.nHeight == MEMPOOL_HEIGHT) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) {
                 // Assume all mempool transaction confirm in the next block
                 prevheights[txinIndex] = tip->nHeight + 1;
             } else {
-                prevheights[txinIndex] = coins.nHeight;
+                prevheights[txinIndex] = coin.nHeight;
             }
         }
         lockPair = CalculateSequenceLocks(tx, flags, &prevheights, index);
@@ -510,9 +512,9 @@ void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
     if (expired != 0)
         LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
 
-    std::vector<uint256> vNoSpendsRemaining;
+    std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
-    BOOST_FOREACH(const uint256& removed, vNoSpendsRemaining)
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
         pcoinsTip->Uncache(removed);
 }
 
@@ -527,7 +529,7 @@ std::string FormatStateMessage(const CValidationState &state)
 
 bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
                               bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+                              std::vector<COutPoint>& vCoinsToUncache)
 {
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
@@ -618,21 +620,18 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        bool fHadTxInCache = pcoinsTip->HaveCoinsInCache(hash);
-        if (view.HaveCoins(hash)) {
-            if (!fHadTxInCache)
-                vHashTxnToUncache.push_back(hash);
-            return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
-        }
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
-                vHashTxnToUncache.push_back(txin.prevout.hash);
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                vCoinsToUncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx?
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    // Optimistically just do efficient check of cache for outputs
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-known");
+                }
+                // Otherwise assume this might be an orphan tx for which we just haven't seen parents yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false; // fMissingInputs and !state.IsInvalid() is used to detect this condition, don't set state.Invalid()
@@ -684,8 +683,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -958,11 +957,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
-    std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vCoinsToUncache);
     if (!res) {
-        BOOST_FOREACH(const uint256& hashTx, vHashTxToUncache)
-            pcoinsTip->Uncache(hashTx);
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
     }
     // After we've (potentially) uncached entries, ensure our coins cache is still within its size limits
     CValidationState stateDummy;
@@ -976,6 +975,67 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
 }
 
+bool PreValidateTransaction(CTxMemPool& pool, const CTransaction& tx)
+{
+    CValidationState state;
+    if (!CheckTransaction(tx, state) || tx.IsCoinBase())
+        return false;
+
+    // Copy the inputs into a private view. Coins that were not cached
+    // before are dropped from pcoinsTip again right away, as
+    // AcceptToMemoryPool does for transactions it rejects.
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    {
+        LOCK2(cs_main, pool.cs);
+        bool witnessEnabled = IsWitnessEnabled(chainActive.Tip(), Params().GetConsensus());
+        if (!tx.wit.IsNull() && !witnessEnabled)
+            return false;
+        std::string reason;
+        if (fRequireStandard && !IsStandardTx(tx, reason, witnessEnabled))
+            return false;
+        if (pool.exists(tx.GetHash()))
+            return false;
+
+        std::vector<COutPoint> vCoinsToUncache;
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        bool fHaveInputs = true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                vCoinsToUncache.push_back(txin.prevout);
+            if (!view.HaveCoin(txin.prevout)) {
+                fHaveInputs = false;
+                break;
+            }
+        }
+        view.SetBackend(dummy);
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
+        if (!fHaveInputs)
+            return false;
+
+        if (!Params().RequireStandard()) {
+            scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+        }
+    }
+
+    // Don't spend CPU on transactions that can't pay for their relay
+    CAmount nValueIn = view.GetValueIn(tx);
+    if (nValueIn < tx.GetValueOut() || nValueIn - tx.GetValueOut() < ::minRelayTxFee.GetFee(GetVirtualTransactionSize(tx)))
+        return false;
+
+    PrecomputedTransactionData txdata(tx);
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const Coin& coin = view.AccessCoin(tx.vin[i].prevout);
+        CScriptCheck check(coin.out, tx, i, scriptVerifyFlags, true, &txdata);
+        if (!check())
+            return false;
+    }
+    return true;
+}
+
 /** Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus::Params& consensusParams, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1012,15 +1072,8 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
-        {
-            const CCoinsViewCache& view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
-        }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+        if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
     }
 
     if (pindexSlow) {
@@ -1267,24 +1320,14 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash(), tx.IsCoinBase())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1322,20 +1365,20 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(false,
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase",
-                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight));
+                        strprintf("tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight));
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
         }
@@ -1378,11 +1421,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1394,7 +1437,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1492,34 +1535,31 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            return error("%s: undo data adding output to missing transaction", __func__);
+        }
+    }
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
@@ -1547,35 +1587,28 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = *(block.vtx[i]);
         uint256 hash = tx.GetHash();
+        bool is_coinbase = tx.IsCoinBase();
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || is_coinbase != (bool)coin.fCoinBase)
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -1624,6 +1657,151 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+/** Hash of a header and whether it has valid proof of work, computed before cs_main is taken. */
+struct CHeaderCheckResult
+{
+    uint256 hash;
+    bool fPowValid;
+};
+
+/**
+ * Closure representing the context-free check of one header. It always
+ * succeeds; the outcome is left in a CHeaderCheckResult so that failures
+ * can be reported in header order afterwards.
+ */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader* pheader;
+    CHeaderCheckResult* presult;
+    const Consensus::Params* pparams;
+
+public:
+    CHeaderCheck(): pheader(NULL), presult(NULL), pparams(NULL) {}
+    CHeaderCheck(const CBlockHeader& header, CHeaderCheckResult& result, const Consensus::Params& params) :
+        pheader(&header), presult(&result), pparams(&params) {}
+
+    bool operator()() {
+        presult->hash = pheader->GetHash();
+        presult->fPowValid = CheckProofOfWork(presult->hash, pheader->nBits, *pparams);
+        return true;
+    }
+
+    void swap(CHeaderCheck& check) {
+        std::swap(pheader, check.pheader);
+        std::swap(presult, check.presult);
+        std::swap(pparams, check.pparams);
+    }
+};
+
+static CCheckQueue<CHeaderCheck> headercheckqueue(128);
+//! Held by the thread that is using headercheckqueue, which allows one user at a time
+static CCriticalSection cs_headercheckqueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("bitcoin-headerch");
+    headercheckqueue.Thread();
+}
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, const std::vector<int64_t>& vAcceptTime,
+                             bool fLimitFree, bool fOverrideMempoolLimit, std::vector<bool>& vAccepted, std::vector<CValidationState>& vState)
+{
+    AssertLockHeld(cs_main);
+    assert(vAcceptTime.empty() || vAcceptTime.size() == vtx.size());
+    vAccepted.assign(vtx.size(), false);
+    vState.assign(vtx.size(), CValidationState());
+
+    // Order the batch parents first, keeping the given order where it already is.
+    std::unordered_map<uint256, size_t, SaltedTxidHasher> mapIndex;
+    for (size_t i = 0; i < vtx.size(); i++)
+        mapIndex.emplace(vtx[i]->GetHash(), i);
+    std::vector<size_t> vParents(vtx.size(), 0);
+    std::vector<std::vector<size_t> > vChildren(vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        std::set<size_t> setParents;
+        for (const CTxIn& txin : vtx[i]->vin) {
+            auto it = mapIndex.find(txin.prevout.hash);
+            if (it != mapIndex.end() && it->second != i && setParents.insert(it->second).second)
+                vChildren[it->second].push_back(i);
+        }
+        vParents[i] = setParents.size();
+    }
+    std::vector<size_t> vOrder;
+    vOrder.reserve(vtx.size());
+    std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t> > queueReady;
+    for (size_t i = 0; i < vtx.size(); i++) {
+        if (vParents[i] == 0)
+            queueReady.push(i);
+    }
+    while (!queueReady.empty()) {
+        size_t i = queueReady.top();
+        queueReady.pop();
+        vOrder.push_back(i);
+        for (size_t child : vChildren[i]) {
+            if (--vParents[child] == 0)
+                queueReady.push(child);
+        }
+    }
+
+    // Verify the scripts of the whole batch on the script check threads.
+    // Outputs of earlier transactions are added to one shared view so that
+    // their children can be checked too. This only fills the signature
+    // cache; failures are found again by AcceptToMemoryPool below.
+    if (nScriptCheckThreads && vOrder.size() > 1) {
+        CCoinsView dummy;
+        CCoinsViewCache view(&dummy);
+        std::vector<PrecomputedTransactionData> vTxData;
+        vTxData.reserve(vOrder.size());
+        std::vector<CScriptCheck> vChecks;
+        unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+        if (!Params().RequireStandard()) {
+            scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+        }
+        bool witnessEnabled = IsWitnessEnabled(chainActive.Tip(), Params().GetConsensus());
+        {
+            LOCK(pool.cs);
+            std::vector<COutPoint> vCoinsToUncache;
+            CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+            view.SetBackend(viewMemPool);
+            for (size_t i : vOrder) {
+                const CTransaction& tx = *vtx[i];
+                if (tx.IsCoinBase() || (!tx.wit.IsNull() && !witnessEnabled) || mapIndex[tx.GetHash()] != i)
+                    continue;
+                bool fHaveInputs = true;
+                for (const CTxIn& txin : tx.vin) {
+                    if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                        vCoinsToUncache.push_back(txin.prevout);
+                    if (!view.HaveCoin(txin.prevout)) {
+                        fHaveInputs = false;
+                        break;
+                    }
+                }
+                if (!fHaveInputs)
+                    continue;
+                vTxData.emplace_back(tx);
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    vChecks.push_back(CScriptCheck());
+                    CScriptCheck check(view.AccessCoin(tx.vin[j].prevout).out, tx, j, scriptVerifyFlags, true, &vTxData.back());
+                    check.swap(vChecks.back());
+                }
+                AddCoins(view, tx, MEMPOOL_HEIGHT);
+            }
+            view.SetBackend(dummy);
+            for (const COutPoint& outpoint : vCoinsToUncache)
+                pcoinsTip->Uncache(outpoint);
+        }
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    int64_t nNow = GetTime();
+    for (size_t i : vOrder) {
+        vAccepted[i] = AcceptToMemoryPoolWithTime(pool, vState[i], *vtx[i], fLimitFree, NULL,
+                                                  vAcceptTime.empty() ? nNow : vAcceptTime[i], fOverrideMempoolLimit);
+    }
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1740,10 +1918,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (fEnforceBIP30) {
         for (const auto& tx : block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx->GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (size_t o = 0; o < tx->vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx->GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
@@ -1810,7 +1990,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             // be in ConnectBlock because they require the UTXO set
             prevheights.resize(tx.vin.size());
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                prevheights[j] = view.AccessCoins(tx.vin[j].prevout.hash)->nHeight;
+                prevheights[j] = view.AccessCoin(tx.vin[j].prevout).nHeight;
             }
 
             if (!SequenceLocks(tx, nLockTimeFlags, &prevheights, *pindex)) {
@@ -1982,25 +2162,29 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // The write may continue in the background. Wait for it when shutting
+        // down, and before removing block files a replay could still need.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsTip->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
+    // Finally remove any pruned files
+    if (fFlushForPrune)
+        UnlinkPrunedFiles(setFilesToPrune);
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
         // Update best block in wallet (so we can detect restored wallets).
         GetMainSignals().SetBestChain(chainActive.GetLocator());
@@ -2111,12 +2295,14 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
+        // Validation errors in resurrected transactions are ignored.
         std::vector<uint256> vHashUpdate;
-        for (const auto& it : block.vtx) {
-            const CTransaction& tx = *it;
-            // ignore validation errors in resurrected transactions
-            CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
+        std::vector<bool> vAccepted;
+        std::vector<CValidationState> vStateDummy;
+        AcceptToMemoryPoolBatch(mempool, block.vtx, std::vector<int64_t>(), false, true, vAccepted, vStateDummy);
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = *block.vtx[i];
+            if (tx.IsCoinBase() || !vAccepted[i]) {
                 mempool.removeRecursive(tx);
             } else if (mempool.exists(tx.GetHash())) {
                 vHashUpdate.push_back(tx.GetHash());
@@ -2555,23 +2741,23 @@ bool ResetBlockFailureFlags(CBlockIndex *pindex) {
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256* phash = NULL)
 {
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = phash ? *phash : block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    BlockMap::iterator mi = mapBlockIndex.insert(hash).first;
+    CBlockIndex* pindexNew = mi->second;
+    *pindexNew = CBlockIndex(block);
+    pindexNew->phashBlock = &((*mi).first);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
-    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -2980,11 +3166,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, const Co
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, const CHeaderCheckResult* pchecked = NULL)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
-    uint256 hash = block.GetHash();
+    uint256 hash = pchecked ? pchecked->hash : block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex *pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -2999,7 +3185,8 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        // A failed precomputed check is repeated to fill in state
+        if (!(pchecked && pchecked->fPowValid) && !CheckBlockHeader(block, state, chainparams.GetConsensus()))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3019,7 +3206,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, &hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3032,10 +3219,32 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
 // Exposed wrapper for AcceptBlockHeader
 bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
 {
+    // Hash the headers and check their proof of work before taking cs_main.
+    // Large batches are spread over the header check threads, unless another
+    // batch is using them already.
+    std::vector<CHeaderCheckResult> vChecked(headers.size());
+    {
+        std::vector<CHeaderCheck> vChecks;
+        vChecks.reserve(headers.size());
+        for (size_t i = 0; i < headers.size(); i++)
+            vChecks.emplace_back(headers[i], vChecked[i], chainparams.GetConsensus());
+
+        TRY_LOCK(cs_headercheckqueue, lockQueue);
+        bool fParallel = lockQueue && nScriptCheckThreads && headers.size() >= MIN_PARALLEL_HEADER_CHECKS;
+        CCheckQueueControl<CHeaderCheck> control(fParallel ? &headercheckqueue : NULL);
+        if (fParallel) {
+            control.Add(vChecks);
+        } else {
+            for (CHeaderCheck& check : vChecks)
+                check();
+        }
+        control.Wait();
+    }
+
     {
         LOCK(cs_main);
-        for (const CBlockHeader& header : headers) {
-            if (!AcceptBlockHeader(header, state, chainparams, ppindex)) {
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (!AcceptBlockHeader(headers[i], state, chainparams, ppindex, &vChecked[i])) {
                 return false;
             }
         }
@@ -3326,24 +3535,81 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     if (hash.IsNull())
         return NULL;
 
-    // Return existing
-    BlockMap::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    // Return existing or create new
+    return mapBlockIndex.insert(hash).first->second;
+}
 
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
 
-    return pindexNew;
+/** Populate mapBlockIndex from the block index snapshot, if there is one matching the database. */
+static bool LoadBlockIndexSnapshot()
+{
+    uint64_t nId;
+    if (!pblocktree->ReadSnapshotId(nId))
+        return false;
+    CBlockIndexSnapshot snapshot;
+    if (!snapshot.Open(GetBlockIndexSnapshotPath()) || snapshot.GetId() != nId) {
+        LogPrintf("%s: block index snapshot missing or stale, reading the database\n", __func__);
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    mapBlockIndex.reserve(snapshot.size());
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        uint256 hash, hashPrev;
+        CBlockIndex index;
+        snapshot.GetRecord(i, hash, hashPrev, index);
+        std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(hash);
+        CBlockIndex* pindexPrev = hashPrev.IsNull() ? NULL : mapBlockIndex[hashPrev];
+        if (!ret.second || (!hashPrev.IsNull() && (pindexPrev == NULL || pindexPrev->nHeight != index.nHeight - 1))) {
+            // Records are in height order, so a parent must precede its children.
+            LogPrintf("%s: block index snapshot is inconsistent, reading the database\n", __func__);
+            mapBlockIndex.clear();
+            return false;
+        }
+        CBlockIndex* pindex = ret.first->second;
+        *pindex = index;
+        pindex->phashBlock = &ret.first->first;
+        pindex->pprev = pindexPrev;
+    }
+    LogPrintf("%s: loaded %u block index entries from snapshot in %.2fms\n", __func__, (unsigned int)snapshot.size(), (GetTimeMicros() - nStart) * 0.001);
+    return true;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    // Entries that have not been written to the database would be lost on the next start.
+    if (!setDirtyBlockIndex.empty() || mapBlockIndex.empty())
+        return false;
+
+    int64_t nStart = GetTimeMicros();
+    vector<pair<int, const CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    std::vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(vSortedByHeight.size());
+    for (size_t i = 0; i < vSortedByHeight.size(); i++)
+        vIndex.push_back(vSortedByHeight[i].second);
+
+    uint64_t nId = GetRand(std::numeric_limits<uint64_t>::max());
+    if (!CBlockIndexSnapshot::Write(GetBlockIndexSnapshotPath(), nId, vIndex))
+        return false;
+    if (!pblocktree->WriteSnapshotId(nId))
+        return error("%s: failed to record block index snapshot", __func__);
+    LogPrintf("%s: wrote %u block index entries in %.2fms\n", __func__, (unsigned int)vIndex.size(), (GetTimeMicros() - nStart) * 0.001);
+    return true;
 }
 
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    bool fSnapshot = LoadBlockIndexSnapshot();
+    if (!fSnapshot && !pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
         return false;
 
     boost::this_thread::interruption_point();
@@ -3356,7 +3622,9 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         CBlockIndex* pindex = item.second;
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    // Entries loaded from the snapshot were inserted in height order already.
+    if (!fSnapshot)
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
@@ -3434,6 +3702,10 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Finish a chainstate write that was interrupted
+    if (!ReplayBlocks(chainparams, pcoinsTip))
+        return error("%s: unable to replay blocks, restart with -reindex-chainstate", __func__);
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3553,6 +3825,86 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
     return true;
 }
 
+/** Apply the effects of a block on the utxo cache, ignoring that it may already have been applied. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& inputs, const CChainParams& params)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus()))
+        return error("ReplayBlocks(): ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+
+    for (const auto& tx : block.vtx) {
+        if (!tx->IsCoinBase()) {
+            for (const auto& txin : tx->vin)
+                inputs.SpendCoin(txin.prevout);
+        }
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(inputs, *tx, pindex->nHeight, true);
+    }
+    return true;
+}
+
+bool ReplayBlocks(const CChainParams& params, CCoinsView* view)
+{
+    LOCK(cs_main);
+
+    CCoinsViewCache cache(view);
+
+    std::vector<uint256> hashHeads = view->GetHeadBlocks();
+    if (hashHeads.empty()) return true; // We're already in a consistent state.
+    if (hashHeads.size() != 2) return error("ReplayBlocks(): unknown inconsistent state");
+
+    uiInterface.ShowProgress(_("Replaying blocks..."), 0);
+    LogPrintf("Replaying blocks\n");
+
+    CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted flush.
+    CBlockIndex* pindexNew;         // New tip during the interrupted flush.
+    CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(hashHeads[0]) == 0)
+        return error("ReplayBlocks(): reorganization to unknown block requested");
+    pindexNew = mapBlockIndex[hashHeads[0]];
+
+    if (!hashHeads[1].IsNull()) { // The old tip is allowed to be null, indicating it's the first flush.
+        if (mapBlockIndex.count(hashHeads[1]) == 0)
+            return error("ReplayBlocks(): reorganization from unknown block requested");
+        pindexOld = mapBlockIndex[hashHeads[1]];
+        pindexFork = LastCommonAncestor(pindexOld, pindexNew);
+    }
+
+    // Rollback along the old branch.
+    CValidationState state;
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus()))
+                return error("ReplayBlocks(): ReadBlockFromDisk() failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            // An unclean disconnect means a missing output was deleted or an existing one
+            // overwritten, which happens when the block never had all of its changes written.
+            // Both operations are idempotent, so the effects of the block are still undone.
+            bool fClean = true;
+            cache.SetBestBlock(pindexOld->GetBlockHash());
+            if (!DisconnectBlock(block, state, pindexOld, cache, &fClean))
+                return error("ReplayBlocks(): DisconnectBlock failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        const CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache, params))
+            return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    cache.Flush();
+    uiInterface.ShowProgress("", 100);
+    return true;
+}
+
 bool RewindBlockIndex(const CChainParams& params)
 {
     LOCK(cs_main);
@@ -3659,9 +4011,6 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
     fHavePruned = false;
 }
@@ -4028,7 +4377,76 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+//! mempool.dat format with one record per transaction and no checksums
+static const uint64_t MEMPOOL_DUMP_VERSION_LEGACY = 1;
+//! mempool.dat format made of checksummed chunks of CMempoolDumpEntry
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+//! Number of transactions LoadMempool hands to AcceptToMemoryPoolBatch at once,
+//! which is also the number of entries per mempool.dat chunk
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+
+namespace {
+
+/**
+ * A mempool.dat record: a transaction with the state its entry had when the
+ * pool was dumped. Entries are written in order of ancestor count, so every
+ * in-pool parent precedes its children. The fee, size and sigop figures are
+ * informational; loading re-validates each transaction against the current
+ * chain.
+ */
+struct CMempoolDumpEntry
+{
+    CTransactionRef tx;
+    int64_t nTime;
+    int64_t nFeeDelta;
+    CAmount nFee;
+    int64_t nTxSize;
+    int64_t nSigOpCost;
+    uint64_t nCountWithAncestors;
+
+    CMempoolDumpEntry() : nTime(0), nFeeDelta(0), nFee(0), nTxSize(0), nSigOpCost(0), nCountWithAncestors(0) {}
+
+    explicit CMempoolDumpEntry(const CTxMemPoolEntry& entry) :
+        tx(entry.GetSharedTx()), nTime(entry.GetTime()), nFeeDelta(entry.GetModifiedFee() - entry.GetFee()),
+        nFee(entry.GetFee()), nTxSize(entry.GetTxSize()), nSigOpCost(entry.GetSigOpCost()),
+        nCountWithAncestors(entry.GetCountWithAncestors()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(tx);
+        READWRITE(nTime);
+        READWRITE(nFeeDelta);
+        READWRITE(nFee);
+        READWRITE(VARINT(nTxSize));
+        READWRITE(VARINT(nSigOpCost));
+        READWRITE(VARINT(nCountWithAncestors));
+    }
+};
+
+/** Write a serialized chunk followed by its checksum. */
+void WriteMempoolChunk(CAutoFile& file, const CDataStream& ss)
+{
+    std::vector<unsigned char> vchChunk(ss.begin(), ss.end());
+    file << vchChunk;
+    file << Hash(vchChunk.begin(), vchChunk.end());
+}
+
+/** Read a chunk into ss. Returns false if its checksum does not match. */
+bool ReadMempoolChunk(CAutoFile& file, CDataStream& ss)
+{
+    std::vector<unsigned char> vchChunk;
+    uint256 hashChunk;
+    file >> vchChunk;
+    file >> hashChunk;
+    if (Hash(vchChunk.begin(), vchChunk.end()) != hashChunk)
+        return false;
+    ss = CDataStream(vchChunk, SER_DISK, CLIENT_VERSION);
+    return true;
+}
+
+} // anon namespace
 
 bool LoadMempool(void)
 {
@@ -4044,42 +4462,89 @@ bool LoadMempool(void)
     int64_t skipped = 0;
     int64_t failed = 0;
     int64_t nNow = GetTime();
+    double prioritydummy = 0;
+
+    std::vector<CTransactionRef> vtx;
+    std::vector<int64_t> vTime;
+    auto acceptBatch = [&]() {
+        if (vtx.empty())
+            return;
+        std::vector<bool> vAccepted;
+        std::vector<CValidationState> vState;
+        LOCK(cs_main);
+        AcceptToMemoryPoolBatch(mempool, vtx, vTime, true, false, vAccepted, vState);
+        for (const CValidationState& state : vState) {
+            if (state.IsValid()) {
+                ++count;
+            } else {
+                ++failed;
+            }
+        }
+        vtx.clear();
+        vTime.clear();
+    };
+    auto queueTx = [&](const CTransactionRef& tx, int64_t nTime, int64_t nFeeDelta) {
+        CAmount amountdelta = nFeeDelta;
+        if (amountdelta) {
+            mempool.PrioritiseTransaction(tx->GetHash(), tx->GetHash().ToString(), prioritydummy, amountdelta);
+        }
+        if (nTime + nExpiryTimeout > nNow) {
+            vtx.push_back(tx);
+            vTime.push_back(nTime);
+            if (vtx.size() == MEMPOOL_LOAD_BATCH_SIZE)
+                acceptBatch();
+        } else {
+            ++skipped;
+        }
+    };
 
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        if (version != MEMPOOL_DUMP_VERSION && version != MEMPOOL_DUMP_VERSION_LEGACY) {
             return false;
         }
-        uint64_t num;
-        file >> num;
-        double prioritydummy = 0;
-        while (num--) {
-            int64_t nTime;
-            int64_t nFeeDelta;
-            CTransaction tx(deserialize, file);
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
-            if (amountdelta) {
-                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), prioritydummy, amountdelta);
+        std::map<uint256, CAmount> mapDeltas;
+        if (version == MEMPOOL_DUMP_VERSION_LEGACY) {
+            uint64_t num;
+            file >> num;
+            while (num--) {
+                int64_t nTime;
+                int64_t nFeeDelta;
+                CTransactionRef tx;
+                file >> tx;
+                file >> nTime;
+                file >> nFeeDelta;
+                queueTx(tx, nTime, nFeeDelta);
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime);
-                if (state.IsValid()) {
-                    ++count;
-                } else {
-                    ++failed;
+            acceptBatch();
+            file >> mapDeltas;
+        } else {
+            // Each chunk is verified and admitted as one batch before the next
+            // is read, so a damaged file still yields every chunk before the
+            // damage.
+            uint64_t nChunks;
+            file >> nChunks;
+            while (nChunks--) {
+                CDataStream ss(SER_DISK, CLIENT_VERSION);
+                if (!ReadMempoolChunk(file, ss)) {
+                    LogPrintf("Mempool file from disk is corrupt, imported %i transactions before the damaged part\n", count);
+                    return false;
                 }
-            } else {
-                ++skipped;
+                std::vector<CMempoolDumpEntry> vEntries;
+                ss >> vEntries;
+                for (const CMempoolDumpEntry& entry : vEntries) {
+                    queueTx(entry.tx, entry.nTime, entry.nFeeDelta);
+                }
+                acceptBatch();
             }
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            if (!ReadMempoolChunk(file, ss)) {
+                LogPrintf("Mempool file from disk is corrupt, ignoring stored fee deltas\n");
+                return false;
+            }
+            ss >> mapDeltas;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
 
         for (const auto& i : mapDeltas) {
             mempool.PrioritiseTransaction(i.first, i.first.ToString(), prioritydummy, i.second);
@@ -4098,18 +4563,28 @@ void DumpMempool(void)
     int64_t start = GetTimeMicros();
 
     std::map<uint256, CAmount> mapDeltas;
-    std::vector<TxMempoolInfo> vinfo;
+    std::vector<CMempoolDumpEntry> vEntries;
 
+    // Only take a snapshot of the pool under the lock. Transactions are
+    // shared, not copied, so this is cheap; serializing and writing happens
+    // after the lock is released.
     {
         LOCK(mempool.cs);
         for (const auto &i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second.first;
         }
-        vinfo = mempool.infoAll();
+        vEntries.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& entry : mempool.mapTx) {
+            vEntries.push_back(CMempoolDumpEntry(entry));
+        }
     }
 
     int64_t mid = GetTimeMicros();
 
+    std::stable_sort(vEntries.begin(), vEntries.end(), [](const CMempoolDumpEntry& a, const CMempoolDumpEntry& b) {
+        return a.nCountWithAncestors < b.nCountWithAncestors;
+    });
+
     try {
         FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "w");
         if (!filestr) {
@@ -4121,15 +4596,22 @@ void DumpMempool(void)
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
 
-        file << (uint64_t)vinfo.size();
-        for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
-            mapDeltas.erase(i.tx->GetHash());
+        uint64_t nChunks = (vEntries.size() + MEMPOOL_LOAD_BATCH_SIZE - 1) / MEMPOOL_LOAD_BATCH_SIZE;
+        file << nChunks;
+        for (size_t nBegin = 0; nBegin < vEntries.size(); nBegin += MEMPOOL_LOAD_BATCH_SIZE) {
+            size_t nEnd = std::min(vEntries.size(), nBegin + MEMPOOL_LOAD_BATCH_SIZE);
+            CDataStream ss(SER_DISK, CLIENT_VERSION);
+            WriteCompactSize(ss, nEnd - nBegin);
+            for (size_t i = nBegin; i < nEnd; i++) {
+                ss << vEntries[i];
+                mapDeltas.erase(vEntries[i].tx->GetHash());
+            }
+            WriteMempoolChunk(file, ss);
         }
 
-        file << mapDeltas;
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << mapDeltas;
+        WriteMempoolChunk(file, ss);
         FileCommit(file.Get());
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
@@ -4146,9 +4628,6 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
     }
 } instance_of_cmaincleanup;
@@ -11,6 +11,8 @@
 #include "wallet/coincontrol.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "crypto/ripemd160.h"
+#include "hash.h"
 #include "key.h"
 #include "keystore.h"
 #include "validation.h"
@@ -1463,13 +1465,214 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
+void CWalletScriptFilter::AddWatchOnly(const CScript& script)
+{
+    setWatchOnly.insert(ReadLE64(Hash160(script.begin(), script.end()).begin()));
+}
+
+bool CWalletScriptFilter::MayBeMine(const CScript& scriptPubKey) const
+{
+    if (!setWatchOnly.empty() && setWatchOnly.count(ReadLE64(Hash160(scriptPubKey.begin(), scriptPubKey.end()).begin())))
+        return true;
+
+    // Mirrors the cases in IsMine, without the checks that can only reject
+    vector<vector<unsigned char> > vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        return Contains(CPubKey(vSolutions[0]).GetID());
+    case TX_PUBKEYHASH:
+    case TX_WITNESS_V0_KEYHASH:
+    case TX_SCRIPTHASH:
+        return Contains(uint160(vSolutions[0]));
+    case TX_WITNESS_V0_SCRIPTHASH:
+    {
+        uint160 hash;
+        CRIPEMD160().Write(&vSolutions[0][0], vSolutions[0].size()).Finalize(hash.begin());
+        return Contains(hash);
+    }
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++) {
+            if (Contains(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CWalletScriptFilter::MayBeMine(const CTransaction& tx) const
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+        if (MayBeMine(txout.scriptPubKey))
+            return true;
+    }
+    return false;
+}
+
+void CWallet::GetScriptFilter(CWalletScriptFilter& filter) const
+{
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        filter.AddKey(keyID);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        filter.AddScript(it->first);
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+        filter.AddWatchOnly(script);
+}
+
+namespace {
+
+/** What a rescan worker found in one block. */
+struct RescanBlock
+{
+    //! Transactions with outputs that may be ours or that are already in the wallet, by position
+    std::vector<std::pair<int, CTransactionRef> > vCandidates;
+    //! Cheap hashes of the txids spent by all other transactions, by position
+    std::vector<std::pair<int, uint64_t> > vSpends;
+};
+
+/** A run of consecutive blocks scanned by one thread. */
+struct RescanChunk
+{
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CDiskBlockPos> vPos;
+    std::vector<RescanBlock> vBlocks;
+    bool fClaimed;
+    bool fDone;
+
+    RescanChunk() : fClaimed(false), fDone(false) {}
+};
+
+/** State shared between a rescan and its worker threads. */
+struct RescanQueue
+{
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    //! Chunks in chain order that have not been merged yet (protected by cs)
+    std::deque<boost::shared_ptr<RescanChunk> > queue;
+    bool fStop;
+
+    const CWalletScriptFilter& filter;
+    //! Cheap hashes of the txids in the wallet when the rescan started
+    const boost::unordered_set<uint64_t>& setWalletTxs;
+    const Consensus::Params& consensus;
+
+    boost::thread_group threadGroup;
+
+    RescanQueue(const CWalletScriptFilter& filterIn, const boost::unordered_set<uint64_t>& setWalletTxsIn, const Consensus::Params& consensusIn) :
+        fStop(false), filter(filterIn), setWalletTxs(setWalletTxsIn), consensus(consensusIn) {}
+
+    ~RescanQueue()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+            cond.notify_all();
+        }
+        threadGroup.join_all();
+    }
+
+    //! Claim the oldest chunk no thread is working on. Requires cs.
+    boost::shared_ptr<RescanChunk> Claim()
+    {
+        BOOST_FOREACH(const boost::shared_ptr<RescanChunk>& chunk, queue) {
+            if (!chunk->fClaimed) {
+                chunk->fClaimed = true;
+                return chunk;
+            }
+        }
+        return boost::shared_ptr<RescanChunk>();
+    }
+};
+
+/** Read the blocks of a chunk and keep what may concern the wallet. Takes no locks. */
+void ScanChunk(const RescanQueue& rescan, RescanChunk& chunk)
+{
+    chunk.vBlocks.resize(chunk.vIndex.size());
+    for (size_t i = 0; i < chunk.vIndex.size(); i++) {
+        CBlock block;
+        if (chunk.vPos[i].IsNull() || !ReadBlockFromDisk(block, chunk.vPos[i], rescan.consensus) || block.GetHash() != chunk.vIndex[i]->GetBlockHash())
+            continue;
+        RescanBlock& result = chunk.vBlocks[i];
+        for (int posInBlock = 0; posInBlock < (int)block.vtx.size(); posInBlock++) {
+            const CTransaction& tx = *block.vtx[posInBlock];
+            if (rescan.setWalletTxs.count(tx.GetHash().GetCheapHash()) || rescan.filter.MayBeMine(tx)) {
+                result.vCandidates.push_back(std::make_pair(posInBlock, block.vtx[posInBlock]));
+            } else if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    result.vSpends.push_back(std::make_pair(posInBlock, txin.prevout.hash.GetCheapHash()));
+            }
+        }
+    }
+}
+
+void ThreadRescan(RescanQueue* rescan)
+{
+    boost::unique_lock<boost::mutex> lock(rescan->cs);
+    while (true) {
+        boost::shared_ptr<RescanChunk> chunk;
+        while (!rescan->fStop && !(chunk = rescan->Claim()))
+            rescan->cond.wait(lock);
+        if (!chunk)
+            return;
+        lock.unlock();
+        ScanChunk(*rescan, *chunk);
+        lock.lock();
+        chunk->fDone = true;
+        rescan->cond.notify_all();
+    }
+}
+
+} // anon namespace
+
+/**
+ * Scan the active chain from pindexStart for wallet transactions.
+ *
+ * Blocks are read in chunks by up to -rescanthreads threads, which only keep
+ * the transactions whose outputs pass the wallet's script filter, and the
+ * txids spent by the others. Chunks are merged in chain order with cs_main
+ * and cs_wallet held; a transaction spending something the wallet knows at
+ * that point is read again from its block. The locks are released between
+ * chunks.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+
+    CWalletScriptFilter filter;
+    GetScriptFilter(filter);
+    boost::unordered_set<uint64_t> setWalletTxs;
+    // Cheap hashes of the txids in the wallet and of those spent by it, so
+    // that spends of wallet outputs and conflicts can be spotted
+    boost::unordered_set<uint64_t> setSpendable;
+    size_t nWalletTxs;
+    {
+        LOCK(cs_wallet);
+        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTxs.insert(it->first.GetCheapHash());
+        setSpendable = setWalletTxs;
+        for (TxSpends::const_iterator it = mapTxSpends.begin(); it != mapTxSpends.end(); ++it)
+            setSpendable.insert(it->first.hash.GetCheapHash());
+        nWalletTxs = mapWallet.size();
+    }
+
     CBlockIndex* pindex = pindexStart;
+    CBlockIndex* pindexLastQueued = NULL;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1479,27 +1682,127 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
-        {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+    }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            int posInBlock;
-            for (posInBlock = 0; posInBlock < (int)block.vtx.size(); posInBlock++)
+    RescanQueue rescan(filter, setWalletTxs, chainParams.GetConsensus());
+    for (int i = 1; i < nThreads; i++)
+        rescan.threadGroup.create_thread(boost::bind(&ThreadRescan, &rescan));
+
+    while (true) {
+        // Keep every thread busy with a chunk while this one merges
+        while (pindex) {
+            {
+                boost::unique_lock<boost::mutex> lock(rescan.cs);
+                if (rescan.queue.size() >= (size_t)nThreads * 2)
+                    break;
+            }
+            boost::shared_ptr<RescanChunk> chunk(new RescanChunk());
             {
-                if (AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex, posInBlock, fUpdate))
+                LOCK(cs_main);
+                if (pindexLastQueued && !chainActive.Contains(pindexLastQueued)) {
+                    // Reorganized since; the blocks of the new branch have been synced already
+                    const CBlockIndex* pindexFork = chainActive.FindFork(pindexLastQueued);
+                    pindex = pindexFork ? chainActive.Next(pindexFork) : NULL;
+                }
+                while (pindex && chunk->vIndex.size() < (size_t)RESCAN_CHUNK_BLOCKS) {
+                    chunk->vIndex.push_back(pindex);
+                    chunk->vPos.push_back((pindex->nStatus & BLOCK_HAVE_DATA) ? pindex->GetBlockPos() : CDiskBlockPos());
+                    pindexLastQueued = pindex;
+                    pindex = chainActive.Next(pindex);
+                }
+            }
+            if (chunk->vIndex.empty())
+                break;
+            boost::unique_lock<boost::mutex> lock(rescan.cs);
+            rescan.queue.push_back(chunk);
+            rescan.cond.notify_all();
+        }
+
+        boost::shared_ptr<RescanChunk> chunk;
+        {
+            boost::unique_lock<boost::mutex> lock(rescan.cs);
+            if (rescan.queue.empty())
+                break;
+            chunk = rescan.queue.front();
+            while (!chunk->fDone) {
+                // Help out rather than wait while unclaimed chunks are left
+                boost::shared_ptr<RescanChunk> chunkHelp = rescan.Claim();
+                if (chunkHelp) {
+                    lock.unlock();
+                    ScanChunk(rescan, *chunkHelp);
+                    lock.lock();
+                    chunkHelp->fDone = true;
+                    rescan.cond.notify_all();
+                } else {
+                    rescan.cond.wait(lock);
+                }
+            }
+            rescan.queue.pop_front();
+        }
+
+        LOCK2(cs_main, cs_wallet);
+        if (mapWallet.size() != nWalletTxs) {
+            // Transactions were added by someone else since the last chunk
+            for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                setSpendable.insert(it->first.GetCheapHash());
+            for (TxSpends::const_iterator it = mapTxSpends.begin(); it != mapTxSpends.end(); ++it)
+                setSpendable.insert(it->first.hash.GetCheapHash());
+        }
+        for (size_t i = 0; i < chunk->vIndex.size(); i++) {
+            CBlockIndex* pindexBlock = chunk->vIndex[i];
+            if (!chainActive.Contains(pindexBlock))
+                continue;
+            if (pindexBlock->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexBlock, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+            // Walk candidates and spends together in block order, so that a
+            // transaction spending an earlier one of the same block is found
+            const RescanBlock& result = chunk->vBlocks[i];
+            std::vector<std::pair<int, CTransactionRef> >::const_iterator itCandidate = result.vCandidates.begin();
+            std::vector<std::pair<int, uint64_t> >::const_iterator itSpend = result.vSpends.begin();
+            CBlock block;
+            bool fBlockRead = false;
+            while (itCandidate != result.vCandidates.end() || itSpend != result.vSpends.end()) {
+                int posInBlock;
+                CTransactionRef ptx;
+                if (itCandidate != result.vCandidates.end() && (itSpend == result.vSpends.end() || itCandidate->first < itSpend->first)) {
+                    posInBlock = itCandidate->first;
+                    ptx = itCandidate->second;
+                    ++itCandidate;
+                } else {
+                    posInBlock = itSpend->first;
+                    bool fSpendsOurs = false;
+                    for (; itSpend != result.vSpends.end() && itSpend->first == posInBlock; ++itSpend)
+                        fSpendsOurs |= setSpendable.count(itSpend->second) != 0;
+                    if (!fSpendsOurs)
+                        continue;
+                    if (!fBlockRead) {
+                        if (!ReadBlockFromDisk(block, pindexBlock, chainParams.GetConsensus()))
+                            break;
+                        fBlockRead = true;
+                    }
+                    ptx = block.vtx[posInBlock];
+                }
+                if (AddToWalletIfInvolvingMe(*ptx, pindexBlock, posInBlock, fUpdate))
                     ret++;
+                if (mapWallet.count(ptx->GetHash())) {
+                    setSpendable.insert(ptx->GetHash().GetCheapHash());
+                    BOOST_FOREACH(const CTxIn& txin, ptx->vin)
+                        setSpendable.insert(txin.prevout.hash.GetCheapHash());
+                }
             }
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindexBlock->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexBlock));
             }
         }
+        nWalletTxs = mapWallet.size();
+    }
+
+    {
+        LOCK2(cs_main, cs_wallet);
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
     return ret;
@@ -3353,6 +3656,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
                                                             CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Set the number of threads reading blocks during a rescan (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), 1, MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet on startup"));
     if (showDebug)
         strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), DEFAULT_SEND_FREE_TRANSACTIONS));
@@ -28,6 +28,7 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
 
 extern CWallet* pwalletMain;
 
@@ -63,6 +64,12 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads scanning blocks during a rescan
+static const int MAX_RESCAN_THREADS = 16;
+//! Number of blocks a rescan thread reads at a time
+static const int RESCAN_CHUNK_BLOCKS = 32;
 
 extern const char * DEFAULT_WALLET_DAT;
 
@@ -547,6 +554,29 @@ private:
     std::vector<char> _ssExtra;
 };
 
+/**
+ * Compact set of the key and script hashes a wallet knows, used to find the
+ * transactions a rescan has to look at without taking the keystore lock for
+ * every output. It may match outputs that are not ours, but does not miss
+ * any that IsMine would accept when it was built.
+ */
+class CWalletScriptFilter
+{
+private:
+    boost::unordered_set<uint64_t> setHashes;
+    boost::unordered_set<uint64_t> setWatchOnly;
+
+    bool Contains(const uint160& hash) const { return setHashes.count(ReadLE64(hash.begin())) != 0; }
+
+public:
+    void AddKey(const CKeyID& keyID) { setHashes.insert(ReadLE64(keyID.begin())); }
+    void AddScript(const CScriptID& scriptID) { setHashes.insert(ReadLE64(scriptID.begin())); }
+    void AddWatchOnly(const CScript& script);
+
+    bool MayBeMine(const CScript& scriptPubKey) const;
+    bool MayBeMine(const CTransaction& tx) const;
+};
+
 
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
@@ -589,6 +619,8 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    void GetScriptFilter(CWalletScriptFilter& filter) const;
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 